@@ -0,0 +1,217 @@
+#include "cache.h"
+
+#include "hash.h"
+#include "memory.h"
+#include "serialize.h"
+#include "vm.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define CACHE_MAGIC "LOXC"
+#define CACHE_VERSION 6
+
+typedef enum {
+  CONSTANT_INT,
+  CONSTANT_DOUBLE,
+  CONSTANT_SMALL_STRING,
+  CONSTANT_STRING,
+  CONSTANT_FUNCTION,
+  CONSTANT_NIL,
+  CONSTANT_FALSE,
+  CONSTANT_TRUE
+} ConstantTag;
+
+// Everything a cache depends on besides its own contents: the build's
+// value layout and instruction set, and the exact source it came from.
+static void writeHeader(Writer* out, const char* source, int length) {
+  writeChars(out, CACHE_MAGIC, (int)strlen(CACHE_MAGIC));
+  writeInt(out, CACHE_VERSION);
+  writeInt(out, (int32_t)sizeof(Value));
+  writeInt(out, SMALL_STRING_MAX);
+  writeInt(out, OP_JUMP_IF_NOT_LESS_EQUAL + 1);
+  writeInt(out, length);
+  writeInt(out, (int32_t)hashString(source, length));
+}
+
+static bool writeFunction(Writer* out, ObjFunction* function);
+
+static bool writeConstant(Writer* out, Value value) {
+  if (IS_INT(value)) {
+    writeByte(out, CONSTANT_INT);
+    writeInt(out, AS_INT(value));
+  } else if (IS_NUMBER(value)) {
+    double number = AS_NUMBER(value);
+    writeByte(out, CONSTANT_DOUBLE);
+    writeChars(out, (const char*)&number, sizeof(number));
+#ifdef NAN_BOXING
+  } else if (IS_SMALL_STRING(value)) {
+    char chars[sizeof(Value)];
+    smallStringChars(value, chars);
+    writeByte(out, CONSTANT_SMALL_STRING);
+    writeCounted(out, chars, SMALL_STRING_LENGTH(value));
+#endif
+  } else if (IS_STRING(value)) {
+    writeByte(out, CONSTANT_STRING);
+    writeCounted(out, AS_CSTRING(value), AS_STRING(value)->length);
+  } else if (IS_FUNCTION(value)) {
+    writeByte(out, CONSTANT_FUNCTION);
+    return writeFunction(out, AS_FUNCTION(value));
+  } else if (IS_NIL(value)) {
+    writeByte(out, CONSTANT_NIL);
+  } else if (IS_BOOL(value)) {
+    writeByte(out, AS_BOOL(value) ? CONSTANT_TRUE : CONSTANT_FALSE);
+  } else {
+    return false;
+  }
+  return true;
+}
+
+static bool writeFunction(Writer* out, ObjFunction* function) {
+  Chunk* chunk = &function->chunk;
+  writeCode(out, function);
+  if (function->name == NULL)
+    writeInt(out, -1);
+  else
+    writeCounted(out, function->name->chars, function->name->length);
+
+  writeInt(out, chunk->constants.count);
+  for (int i = 0; i < chunk->constants.count; i++)
+    if (!writeConstant(out, chunk->constants.values[i])) return false;
+
+  for (int i = 0; i < chunk->switchCount; i++) {
+    Table* cases = &chunk->switches[i].cases;
+    int count = 0;
+    for (int j = 0; j < cases->capacity; j++)
+      if (!IS_EMPTY(cases->entries[j].key)) count++;
+
+    writeInt(out, count);
+    for (int j = 0; j < cases->capacity; j++) {
+      Entry* entry = &cases->entries[j];
+      if (IS_EMPTY(entry->key)) continue;
+      if (!writeConstant(out, entry->key)) return false;
+      writeInt(out, AS_INT(entry->value));
+    }
+  }
+  return true;
+}
+
+void saveCache(
+    const char* path, ObjFunction* function, const char* source, int length) {
+  Writer out;
+  initWriter(&out);
+  writeHeader(&out, source, length);
+  writeGlobalNames(&out);
+  if (!writeFunction(&out, function)) {
+    freeWriter(&out);
+    return;
+  }
+
+  saveFile(path, &out);
+  freeWriter(&out);
+}
+
+static ObjFunction* readFunction(Reader* in);
+
+// A function is left on the stack for the caller to pop once it is
+// reachable.
+static bool readConstant(Reader* in, Value* constant) {
+  uint8_t tag = readByte(in);
+
+  Value value;
+  switch (tag) {
+    case CONSTANT_INT: value = INT_VAL(readInt(in)); break;
+    case CONSTANT_DOUBLE: {
+      double number = 0;
+      readBytes(in, &number, sizeof(number));
+      value = NUMBER_VAL(number);
+      break;
+    }
+    case CONSTANT_SMALL_STRING:
+    case CONSTANT_STRING: {
+      int length;
+      const char* chars = readCounted(in, &length);
+      if (chars == NULL) return false;
+      value = tag == CONSTANT_SMALL_STRING
+                  ? stringValue(chars, length)
+                  : OBJ_VAL(copyString(chars, length));
+      break;
+    }
+    case CONSTANT_FUNCTION: {
+      ObjFunction* function = readFunction(in);
+      if (function == NULL) return false;
+      value = OBJ_VAL(function);
+      break;
+    }
+    case CONSTANT_NIL: value = NIL_VAL; break;
+    case CONSTANT_FALSE: value = BOOL_VAL(false); break;
+    case CONSTANT_TRUE: value = BOOL_VAL(true); break;
+    default: return false;
+  }
+
+  *constant = value;
+  return !in->failed;
+}
+
+// Leaves the function on the stack so it survives collections triggered
+// while its nested functions and constants are loaded.
+static ObjFunction* readFunction(Reader* in) {
+  ObjFunction* function = newFunction();
+  push(OBJ_VAL(function));
+  readCode(in, function);
+
+  int nameLength = readInt(in);
+  if (nameLength >= 0) {
+    const char* chars = readChars(in, nameLength);
+    if (chars == NULL) return NULL;
+    PUBLISH(function->name, copyString(chars, nameLength));
+    writeBarrier(&function->obj, OBJ_VAL(function->name));
+  }
+
+  Chunk* chunk = &function->chunk;
+  int count = readCount(in, remaining(in));
+  for (int i = 0; i < count; i++) {
+    Value value;
+    if (!readConstant(in, &value)) return NULL;
+    addConstant(chunk, value);
+    writeBarrier(&function->obj, value);
+    if (IS_FUNCTION(value)) pop();
+  }
+
+  for (int i = 0; i < chunk->switchCount; i++) {
+    Table* cases = &chunk->switches[i].cases;
+    count = readCount(in, remaining(in));
+    for (int j = 0; j < count; j++) {
+      Value label;
+      if (!readConstant(in, &label) || IS_FUNCTION(label)) return NULL;
+      push(label);
+      tableSet(cases, label, INT_VAL(readInt(in)));
+      writeBarrier(&function->obj, label);
+      pop();
+    }
+  }
+
+  return in->failed ? NULL : function;
+}
+
+ObjFunction* loadCache(const char* path, const char* source, int length) {
+  int fileSize;
+  char* buffer = loadFile(path, &fileSize);
+  if (buffer == NULL) return NULL;
+
+  Writer header;
+  initWriter(&header);
+  writeHeader(&header, source, length);
+  Reader in = {buffer, buffer + fileSize, false};
+  bool fresh = readHeader(&in, &header);
+  freeWriter(&header);
+
+  ObjFunction* function = NULL;
+  int depth = (int)(vm.stackTop - vm.stack);
+  if (fresh && readGlobalNames(&in)) function = readFunction(&in);
+  if (in.current != in.end) function = NULL;
+  vm.stackTop = vm.stack + depth;
+
+  free(buffer);
+  return function;
+}
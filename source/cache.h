@@ -0,0 +1,10 @@
+#ifndef CLOX_CACHE_H
+#define CLOX_CACHE_H
+
+#include "object.h"
+
+ObjFunction* loadCache(const char* path, const char* source, int length);
+void saveCache(
+    const char* path, ObjFunction* function, const char* source, int length);
+
+#endif
@@ -15,6 +15,12 @@ void initChunk(Chunk* chunk) {
   chunk->callsiteCount = 0;
   chunk->callsiteCapacity = 0;
   chunk->callsites = NULL;
+  chunk->cacheCount = 0;
+  chunk->cacheCapacity = 0;
+  chunk->caches = NULL;
+  chunk->switchCount = 0;
+  chunk->switchCapacity = 0;
+  chunk->switches = NULL;
   initValueArray(&chunk->constants);
 }
 
@@ -22,6 +28,13 @@ void freeChunk(Chunk* chunk) {
   FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
   FREE_ARRAY(LineStart, chunk->lines, chunk->lineCapacity);
   FREE_ARRAY(Callsite, chunk->callsites, chunk->callsiteCapacity);
+  FREE_ARRAY(PropertyCache, chunk->caches, chunk->cacheCapacity);
+  for (int i = 0; i < chunk->switchCount; i++) {
+    SwitchTable* table = &chunk->switches[i];
+    FREE_ARRAY(int, table->offsets, table->length);
+    freeTable(&table->cases);
+  }
+  FREE_ARRAY(SwitchTable, chunk->switches, chunk->switchCapacity);
   freeValueArray(&chunk->constants);
   initChunk(chunk);
 }
@@ -56,6 +69,9 @@ void writeChunk(Chunk* chunk, uint8_t byte, int line) {
 
 void amendChunk(Chunk* chunk, int bytes) {
   chunk->count = chunk->count > bytes ? chunk->count - bytes : 0;
+  while (chunk->lineCount > 0 &&
+         chunk->lines[chunk->lineCount - 1].offset >= chunk->count)
+    chunk->lineCount--;
 }
 
 int addConstant(Chunk* chunk, Value value) {
@@ -65,6 +81,25 @@ int addConstant(Chunk* chunk, Value value) {
   return chunk->constants.count - 1;
 }
 
+int addSwitch(Chunk* chunk) {
+  if (chunk->switchCapacity < chunk->switchCount + 1) {
+    int oldCapacity = chunk->switchCapacity;
+    chunk->switchCapacity = GROW_CAPACITY(oldCapacity);
+    SwitchTable* switches = GROW_ARRAY(
+        SwitchTable, chunk->switches, oldCapacity, chunk->switchCapacity);
+    PUBLISH(chunk->switches, switches);
+  }
+
+  SwitchTable* table = &chunk->switches[chunk->switchCount];
+  table->miss = 0;
+  table->low = 0;
+  table->length = 0;
+  table->offsets = NULL;
+  initTable(&table->cases);
+  PUBLISH(chunk->switchCount, chunk->switchCount + 1);
+  return chunk->switchCount - 1;
+}
+
 int getLine(Chunk* chunk, int instruction) {
   int start = 0;
   int end = chunk->lineCount - 1;
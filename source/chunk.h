@@ -2,9 +2,11 @@
 #define CLOX_CHUNK_H
 
 #include "common.h"
+#include "table.h"
 #include "value.h"
 
 typedef struct Callsite Callsite;
+typedef struct PropertyCache PropertyCache;
 
 typedef enum {
   OP_CONSTANT,
@@ -59,7 +61,20 @@ typedef enum {
   OP_GREATER_EQUAL,
   OP_LESS_EQUAL,
   OP_GET_THIS,
-  OP_DUP
+  OP_DUP,
+  OP_ADD_NUM,
+  OP_ADD_STR,
+  OP_EQUAL_NUM,
+  OP_NOT_EQUAL_NUM,
+  OP_BUILD_STRING,
+  OP_SWITCH,
+  OP_POP_JUMP_IF_FALSE,
+  OP_JUMP_IF_NOT_EQUAL,
+  OP_JUMP_IF_EQUAL,
+  OP_JUMP_IF_NOT_GREATER,
+  OP_JUMP_IF_NOT_GREATER_EQUAL,
+  OP_JUMP_IF_NOT_LESS,
+  OP_JUMP_IF_NOT_LESS_EQUAL
 } OpCode;
 
 typedef struct {
@@ -67,6 +82,17 @@ typedef struct {
   int line;
 } LineStart;
 
+// Where a switch goes for each case, counted from the end of its
+// instruction. Integer cases close together index offsets directly;
+// anything else is looked up in cases.
+typedef struct {
+  int miss;
+  int low;
+  int length;
+  int* offsets;
+  Table cases;
+} SwitchTable;
+
 typedef struct {
   int count;
   int capacity;
@@ -78,6 +104,12 @@ typedef struct {
   int callsiteCount;
   int callsiteCapacity;
   Callsite* callsites;
+  int cacheCount;
+  int cacheCapacity;
+  PropertyCache* caches;
+  int switchCount;
+  int switchCapacity;
+  SwitchTable* switches;
   ValueArray constants;
 } Chunk;
 
@@ -86,6 +118,7 @@ void freeChunk(Chunk* chunk);
 void writeChunk(Chunk* chunk, uint8_t byte, int line);
 void amendChunk(Chunk* chunk, int bytes);
 int addConstant(Chunk* chunk, Value value);
+int addSwitch(Chunk* chunk);
 int getLine(Chunk* chunk, int instruction);
 
 #endif
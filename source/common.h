@@ -13,8 +13,18 @@
 #define FRAMES_MAX 1000
 #endif
 
+#ifndef GC_STEP_BUDGET
+#define GC_STEP_BUDGET 500
+#endif
+
 #define NAN_BOXING
 
+#if defined(__GNUC__) && !defined(NO_COMPUTED_GOTO)
+#define COMPUTED_GOTO
+#endif
+
+// #define CONCURRENT_MARKING
+
 // #define DEBUG_PRINT_TOKENS
 // #define DEBUG_PRINT_CODE
 
@@ -24,6 +34,8 @@
 // #define DEBUG_STRESS_GC
 // #define DEBUG_LOG_GC
 
+// #define DEBUG_LOG_CACHE
+
 #define UINT8_COUNT (UINT8_MAX + 1)
 #define UINT16_COUNT (UINT16_MAX + 1)
 
@@ -2,6 +2,7 @@
 
 #include "common.h"
 #include "memory.h"
+#include "peephole.h"
 #include "scanner.h"
 #include "slots.h"
 #include "vm.h"
@@ -14,6 +15,9 @@
 #include "debug.h"
 #endif
 
+#define NUMBER_DIGITS_MAX 63
+#define DENSE_SWITCH_GAPS 2
+
 typedef struct {
   Token current;
   Token previous;
@@ -73,6 +77,9 @@ typedef struct Compiler {
   Upvalue upvalues[UINT8_COUNT];
   int scopeDepth;
   SlotUsage usage;
+  int constantStart;
+  int constantEnd;
+  Value constant;
 
   int innermostLoopStart;
   int innermostLoopScopeDepth;
@@ -183,6 +190,7 @@ static void emitReturn() {
 
 static uint16_t makeConstant(Value value) {
   int index = addConstant(currentChunk(), value);
+  writeBarrier(&current->function->obj, value);
   if (index == CONSTANTS_MAX) {
     error("Too many constants in one chunk.");
     return 0;
@@ -197,8 +205,66 @@ static void emitConstant(Value value) {
   emitShort(index);
 }
 
+// Emits the cheapest load of a constant and remembers it, so an operator
+// applied to nothing but constants can be evaluated right here.
+static void emitLiteral(Value value) {
+  int start = currentChunk()->count;
+  if (IS_NIL(value)) {
+    emitOp(OP_NIL);
+  } else if (IS_BOOL(value)) {
+    emitOp(AS_BOOL(value) ? OP_TRUE : OP_FALSE);
+#ifndef NO_CONSTANT_OPS
+  } else if (IS_INT(value) && AS_INT(value) >= -1 && AS_INT(value) <= 5) {
+    emitOp((OpCode)(OP_CONSTANT_ZERO + AS_INT(value)));
+#endif
+  } else {
+    emitConstant(value);
+  }
+
+  current->constantStart = start;
+  current->constantEnd = currentChunk()->count;
+  current->constant = value;
+}
+
+// True when the code emitted since start is a single constant load. A
+// jump landing after the load means it is only one branch of the value.
+static bool constantSince(int start, Value* value) {
+  if (current->constantStart != start ||
+      current->constantEnd != currentChunk()->count)
+    return false;
+  *value = current->constant;
+  return true;
+}
+
+static int loadLength(int offset) {
+  return currentChunk()->code[offset] == OP_CONSTANT ? 3 : 1;
+}
+
+static void dropConstant(int offset) {
+  Chunk* chunk = currentChunk();
+  if (chunk->code[offset] != OP_CONSTANT) return;
+  int index = chunk->code[offset + 1] | (chunk->code[offset + 2] << 8);
+  if (index == chunk->constants.count - 1)
+    PUBLISH(chunk->constants.count, chunk->constants.count - 1);
+}
+
+// Replaces the constant loads from start on with a load of their result.
+static void foldConstants(int start, int loads, Value value) {
+  int offsets[2];
+  for (int i = 0, offset = start; i < loads; i++) {
+    offsets[i] = offset;
+    offset += loadLength(offset);
+  }
+  for (int i = loads - 1; i >= 0; i--) dropConstant(offsets[i]);
+
+  amendChunk(currentChunk(), currentChunk()->count - start);
+  current->usage.delta -= loads;
+  emitLiteral(value);
+}
+
 static void patchJump(int offset) {
   int jump = currentChunk()->count - offset - 2;
+  current->constantEnd = -1;
 
   if (jump > UINT16_MAX) error("Too much code to jump over.");
 
@@ -214,11 +280,16 @@ static void initCompiler(Compiler* compiler, FunctionType type) {
   compiler->localCount = 0;
   compiler->scopeDepth = 0;
   compiler->usage = (SlotUsage){0, 0};
+  compiler->constantStart = -1;
+  compiler->constantEnd = -1;
   compiler->function = newFunction();
   current = compiler;
   if (type != TYPE_SCRIPT) {
-    current->function->name =
+    ObjString* name =
         copyString(parser.previous.start, parser.previous.length);
+    PUBLISH(current->function->name, name);
+    writeBarrier(
+        &current->function->obj, OBJ_VAL(current->function->name));
   }
 
   Local* local = &current->locals[current->localCount++];
@@ -240,6 +311,7 @@ static ObjFunction* endCompiler() {
   emitReturn();
   ObjFunction* function = current->function;
   function->chunk.slots = current->usage.peak;
+  if (!parser.hadError) optimizeChunk(&function->chunk);
   freeTable(&current->stringConstants);
 
 #ifdef DEBUG_PRINT_CODE
@@ -284,10 +356,10 @@ static uint16_t identifierConstant(Token* name) {
   Value indexValue;
 
   if (tableGet(&current->stringConstants, OBJ_VAL(string), &indexValue))
-    return (uint16_t)AS_NUMBER(indexValue);
+    return (uint16_t)AS_INT(indexValue);
 
   uint16_t index = makeConstant(OBJ_VAL(string));
-  tableSet(&current->stringConstants, OBJ_VAL(string), NUMBER_VAL(index));
+  tableSet(&current->stringConstants, OBJ_VAL(string), INT_VAL(index));
   return index;
 }
 
@@ -295,12 +367,12 @@ static uint16_t globalIdentifier(Value identifier) {
   Value index;
 
   if (tableGet(&vm.globalNames, identifier, &index))
-    return (uint16_t)AS_NUMBER(index);
+    return (uint16_t)AS_INT(index);
 
   uint16_t newIndex = (uint16_t)vm.globalValues.count;
   push(identifier);
   writeValueArray(&vm.globalValues, UNDEFINED_VAL);
-  tableSet(&vm.globalNames, identifier, NUMBER_VAL(newIndex));
+  tableSet(&vm.globalNames, identifier, INT_VAL(newIndex));
   pop();
   return newIndex;
 }
@@ -431,36 +503,90 @@ static void and_(bool canAssign __attribute__((unused))) {
   patchJump(endJump);
 }
 
-static void simplify(OpCode first, OpCode second, OpCode combined) {
-  if (currentChunk()->code[currentChunk()->count - 1] == first) {
+static void simplify(int start, OpCode first, OpCode second, OpCode combined) {
+  Value constant;
+  if (constantSince(start, &constant) &&
+      currentChunk()->code[start] == first) {
     current->usage.delta -= getUsage(first).delta;
     amendChunk(currentChunk(), 1);
+    current->constantEnd = -1;
     emitOp(combined);
   } else {
     emitOp(second);
   }
 }
 
+// Only operators that cannot fail are folded. Anything that would be a
+// runtime error is left for the VM to report.
+static bool foldBinary(
+    TokenType operatorType, Value a, Value b, Value* result) {
+  if (operatorType == TOKEN_EQUAL_EQUAL || operatorType == TOKEN_BANG_EQUAL) {
+    bool equal = valuesEqual(a, b);
+    *result = BOOL_VAL(operatorType == TOKEN_EQUAL_EQUAL ? equal : !equal);
+    return true;
+  }
+
+  if (operatorType == TOKEN_PLUS && isString(a) && isString(b)) {
+    int length = stringLength(a) + stringLength(b);
+    char* chars = ALLOCATE(char, length + 1);
+    copyChars(a, chars);
+    copyChars(b, chars + stringLength(a));
+    *result = stringValue(chars, length);
+    FREE_ARRAY(char, chars, length + 1);
+    return true;
+  }
+
+  if (!IS_NUMBER(a) || !IS_NUMBER(b)) return false;
+  double x = AS_NUMBER(a);
+  double y = AS_NUMBER(b);
+  switch (operatorType) {
+    case TOKEN_GREATER: *result = BOOL_VAL(x > y); break;
+    case TOKEN_GREATER_EQUAL: *result = BOOL_VAL(x >= y); break;
+    case TOKEN_LESS: *result = BOOL_VAL(x < y); break;
+    case TOKEN_LESS_EQUAL: *result = BOOL_VAL(x <= y); break;
+    case TOKEN_PLUS: *result = numberValue(x + y); break;
+    case TOKEN_MINUS: *result = numberValue(x - y); break;
+    case TOKEN_STAR: *result = numberValue(x * y); break;
+    case TOKEN_SLASH: *result = numberValue(x / y); break;
+    default: return false;
+  }
+  return true;
+}
+
 static void binary(bool canAssign __attribute__((unused))) {
   TokenType operatorType = parser.previous.type;
   ParseRule* rule = getRule(operatorType);
+  int leftStart = current->constantStart;
+  Value left;
+  bool leftConstant = constantSince(leftStart, &left);
+  int rightStart = currentChunk()->count;
   parsePrecedence((Precedence)(rule->precedence + 1));
 
+  Value right;
+  Value result;
+  if (leftConstant && constantSince(rightStart, &right) &&
+      foldBinary(operatorType, left, right, &result)) {
+    foldConstants(leftStart, 2, result);
+    return;
+  }
+
   switch (operatorType) {
     case TOKEN_BANG_EQUAL: emitOp(OP_NOT_EQUAL); break;
     case TOKEN_EQUAL_EQUAL:
-      simplify(OP_CONSTANT_ZERO, OP_EQUAL, OP_EQUAL_ZERO);
+      simplify(rightStart, OP_CONSTANT_ZERO, OP_EQUAL, OP_EQUAL_ZERO);
       break;
     case TOKEN_GREATER: emitOp(OP_GREATER); break;
     case TOKEN_GREATER_EQUAL: emitOp(OP_GREATER_EQUAL); break;
     case TOKEN_LESS: emitOp(OP_LESS); break;
     case TOKEN_LESS_EQUAL: emitOp(OP_LESS_EQUAL); break;
-    case TOKEN_PLUS: simplify(OP_CONSTANT_ONE, OP_ADD, OP_ADD_ONE); break;
+    case TOKEN_PLUS:
+      simplify(rightStart, OP_CONSTANT_ONE, OP_ADD, OP_ADD_ONE);
+      break;
     case TOKEN_MINUS:
-      simplify(OP_CONSTANT_ONE, OP_SUBTRACT, OP_SUBTRACT_ONE);
+      simplify(rightStart, OP_CONSTANT_ONE, OP_SUBTRACT, OP_SUBTRACT_ONE);
       break;
     case TOKEN_STAR:
-      simplify(OP_CONSTANT_TWO, OP_MULTIPLY, OP_MULTIPLY_TWO);
+      simplify(rightStart, OP_CONSTANT_TWO, OP_MULTIPLY, OP_MULTIPLY_TWO);
       break;
     case TOKEN_SLASH: emitOp(OP_DIVIDE); break;
     default: return;
@@ -490,13 +616,49 @@ static void emitCallsite() {
   if (chunk->callsiteCapacity < chunk->callsiteCount + 1) {
     int oldCapacity = chunk->callsiteCapacity;
     chunk->callsiteCapacity = GROW_CAPACITY(oldCapacity);
-    chunk->callsites = GROW_ARRAY(
+    Callsite* callsites = GROW_ARRAY(
         Callsite, chunk->callsites, oldCapacity, chunk->callsiteCapacity);
+    PUBLISH(chunk->callsites, callsites);
   }
 
-  Callsite* callsite = &chunk->callsites[chunk->callsiteCount++];
-  callsite->klass = NULL;
-  callsite->method = NULL;
+  Callsite* callsite = &chunk->callsites[chunk->callsiteCount];
+  callsite->count = 0;
+  callsite->megamorphic = false;
+#ifdef DEBUG_LOG_CACHE
+  callsite->hits = 0;
+  callsite->misses = 0;
+#endif
+  PUBLISH(chunk->callsiteCount, chunk->callsiteCount + 1);
+}
+
+static void emitPropertyCache() {
+  Chunk* chunk = currentChunk();
+
+  if (chunk->cacheCount == UINT16_COUNT) {
+    error("Too many property accesses in one chunk.");
+    return;
+  }
+
+  emitShort(chunk->cacheCount);
+
+  if (chunk->cacheCapacity < chunk->cacheCount + 1) {
+    int oldCapacity = chunk->cacheCapacity;
+    chunk->cacheCapacity = GROW_CAPACITY(oldCapacity);
+    PropertyCache* caches = GROW_ARRAY(
+        PropertyCache, chunk->caches, oldCapacity, chunk->cacheCapacity);
+    PUBLISH(chunk->caches, caches);
+  }
+
+  PropertyCache* cache = &chunk->caches[chunk->cacheCount];
+  cache->shape = NULL;
+  cache->transition = NULL;
+  cache->method = NULL;
+  cache->slot = -1;
+#ifdef DEBUG_LOG_CACHE
+  cache->hits = 0;
+  cache->misses = 0;
+#endif
+  PUBLISH(chunk->cacheCount, chunk->cacheCount + 1);
 }
 
 static void dot(bool canAssign) {
@@ -507,6 +669,7 @@ static void dot(bool canAssign) {
     expression();
     emitOp(OP_SET_PROPERTY);
     emitShort(name);
+    emitPropertyCache();
   } else if (match(TOKEN_LEFT_PAREN)) {
     uint8_t argCount = argumentList();
     emitOp(OP_INVOKE);
@@ -516,20 +679,21 @@ static void dot(bool canAssign) {
   } else {
     emitOp(OP_GET_PROPERTY);
     emitShort(name);
+    emitPropertyCache();
   }
 }
 
 static void literal(bool canAssign __attribute__((unused))) {
   switch (parser.previous.type) {
-    case TOKEN_FALSE: emitOp(OP_FALSE); break;
-    case TOKEN_NIL: emitOp(OP_NIL); break;
-    case TOKEN_TRUE: emitOp(OP_TRUE); break;
+    case TOKEN_FALSE: emitLiteral(BOOL_VAL(false)); break;
+    case TOKEN_NIL: emitLiteral(NIL_VAL); break;
+    case TOKEN_TRUE: emitLiteral(BOOL_VAL(true)); break;
     default: return;
   }
 }
 
 static void conditional(bool canAssign __attribute__((unused))) {
-  int thenJump = emitJump(OP_JUMP_IF_FALSE);
+  int thenJump = emitJump(OP_POP_JUMP_IF_FALSE);
 
   parsePrecedence(PREC_CONDITIONAL);
 
@@ -549,27 +713,17 @@ static void grouping(bool canAssign __attribute__((unused))) {
 }
 
 static void number(bool canAssign __attribute__((unused))) {
-  double value = strtod(parser.previous.start, NULL);
+  char digits[NUMBER_DIGITS_MAX + 1];
+  int length = parser.previous.length;
+  char* text =
+      length <= NUMBER_DIGITS_MAX ? digits : (char*)malloc(length + 1);
+  if (text == NULL) exit(1);
+  memcpy(text, parser.previous.start, length);
+  text[length] = '\0';
+  double value = strtod(text, NULL);
+  if (text != digits) free(text);
 
-#ifndef NO_CONSTANT_OPS
-  if (value == 0) {
-    emitOp(OP_CONSTANT_ZERO);
-  } else if (value == 1) {
-    emitOp(OP_CONSTANT_ONE);
-  } else if (value == 2) {
-    emitOp(OP_CONSTANT_TWO);
-  } else if (value == 3) {
-    emitOp(OP_CONSTANT_THREE);
-  } else if (value == 4) {
-    emitOp(OP_CONSTANT_FOUR);
-  } else if (value == 5) {
-    emitOp(OP_CONSTANT_FIVE);
-  } else {
-    emitConstant(NUMBER_VAL(value));
-  }
-#else
-  emitConstant(NUMBER_VAL(value));
-#endif
+  emitLiteral(numberValue(value));
 }
 
 static void or_(bool canAssign __attribute__((unused))) {
@@ -584,8 +738,8 @@ static void or_(bool canAssign __attribute__((unused))) {
 }
 
 static void string(bool canAssign __attribute__((unused))) {
-  emitConstant(OBJ_VAL(
-      copyString(parser.previous.start + 1, parser.previous.length - 2)));
+  emitLiteral(
+      stringValue(parser.previous.start + 1, parser.previous.length - 2));
 }
 
 static void namedVariable(Token name, bool canAssign) {
@@ -633,24 +787,39 @@ static Token syntheticToken(const char* text) {
   return token;
 }
 
+static void emitBuildString(uint8_t parts) {
+  emitOp(OP_BUILD_STRING);
+  emitByte(parts);
+  current->usage.delta -= parts;
+}
+
+static int reservePart(int parts) {
+  if (parts < UINT8_MAX) return parts;
+  emitBuildString(parts);
+  return 1;
+}
+
+static int stringPart(int parts, int trim) {
+  if (parser.previous.length <= trim) return parts;
+  parts = reservePart(parts);
+  emitConstant(
+      stringValue(parser.previous.start + 1, parser.previous.length - trim));
+  return parts + 1;
+}
+
 static void interpolate(bool canAssign __attribute__((unused))) {
-  bool init = false;
+  int parts = 0;
   do {
-    emitConstant(OBJ_VAL(
-        copyString(parser.previous.start + 1, parser.previous.length - 3)));
-    if (init)
-      emitOp(OP_ADD);
-    else
-      init = true;
-    if (*parser.current.start == '}') errorAtCurrent("Expect expression.");
-    namedVariable(syntheticToken("str"), false);
+    parts = stringPart(parts, 3);
+    if (parser.current.length > 0 && *parser.current.start == '}')
+      errorAtCurrent("Expect expression.");
+    parts = reservePart(parts);
     expression();
-    emitCall(1);
-    emitOp(OP_ADD);
+    parts++;
   } while (match(TOKEN_INTERPOLATE));
   consume(TOKEN_STRING, "Expect end of string interpolation.");
-  string(false);
-  emitOp(OP_ADD);
+  parts = stringPart(parts, 2);
+  emitBuildString(parts);
 }
 
 static void super_(bool canAssign __attribute__((unused))) {
@@ -690,13 +859,25 @@ static void this_(bool canAssign __attribute__((unused))) {
 
 static void unary(bool canAssign __attribute__((unused))) {
   TokenType operatorType = parser.previous.type;
+  int start = currentChunk()->count;
 
   parsePrecedence(PREC_UNARY);
+  Value operand;
+  if (constantSince(start, &operand)) {
+    if (operatorType == TOKEN_BANG) {
+      bool falsey = IS_NIL(operand) || (IS_BOOL(operand) && !AS_BOOL(operand));
+      foldConstants(start, 1, BOOL_VAL(falsey));
+      return;
+    }
+    if (operatorType == TOKEN_MINUS && IS_NUMBER(operand)) {
+      foldConstants(start, 1, numberValue(-AS_NUMBER(operand)));
+      return;
+    }
+  }
+
   switch (operatorType) {
     case TOKEN_BANG: emitOp(OP_NOT); break;
-    case TOKEN_MINUS:
-      simplify(OP_CONSTANT_ONE, OP_NEGATE, OP_CONSTANT_NEGATIVE_ONE);
-      break;
+    case TOKEN_MINUS: emitOp(OP_NEGATE); break;
     default: return;
   }
 }
@@ -915,8 +1096,7 @@ static void forStatement() {
   if (!match(TOKEN_SEMICOLON)) {
     expression();
     consume(TOKEN_SEMICOLON, "Expect ';' after loop condition.");
-    exitJump = emitJump(OP_JUMP_IF_FALSE);
-    emitOp(OP_POP);
+    exitJump = emitJump(OP_POP_JUMP_IF_FALSE);
   }
 
   if (!match(TOKEN_RIGHT_PAREN)) {
@@ -934,10 +1114,7 @@ static void forStatement() {
   statement();
   emitLoop(current->innermostLoopStart);
 
-  if (exitJump != -1) {
-    patchJump(exitJump);
-    emitOp(OP_POP);
-  }
+  if (exitJump != -1) patchJump(exitJump);
 
   current->innermostLoopStart = surroundingLoopStart;
   current->innermostLoopScopeDepth = surroundingLoopScopeDepth;
@@ -949,31 +1126,81 @@ static void ifStatement() {
   expression();
   consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
 
-  int thenJump = emitJump(OP_JUMP_IF_FALSE);
-  emitOp(OP_POP);
+  int thenJump = emitJump(OP_POP_JUMP_IF_FALSE);
   statement();
 
   int elseJump = emitJump(OP_JUMP);
 
   patchJump(thenJump);
-  current->usage.delta++;
-  emitOp(OP_POP);
-
   if (match(TOKEN_ELSE)) statement();
   patchJump(elseJump);
 }
 
+static int emitSwitch() {
+  Chunk* chunk = currentChunk();
+
+  if (chunk->switchCount == UINT16_COUNT) {
+    error("Too many switch statements in one chunk.");
+    return 0;
+  }
+
+  emitOp(OP_SWITCH);
+  emitShort(chunk->switchCount);
+  return addSwitch(chunk);
+}
+
+// Integer cases without many gaps between them get a dense table.
+static void finishSwitch(int index, int miss) {
+  SwitchTable* table = &currentChunk()->switches[index];
+  table->miss = miss;
+
+  int32_t low = INT32_MAX;
+  int32_t high = INT32_MIN;
+  for (int i = 0; i < table->cases.capacity; i++) {
+    Entry* entry = &table->cases.entries[i];
+    if (IS_EMPTY(entry->key)) continue;
+    if (!IS_NUMBER(entry->key) || !isInt32(AS_NUMBER(entry->key))) return;
+
+    int32_t label = (int32_t)AS_NUMBER(entry->key);
+    if (label < low) low = label;
+    if (label > high) high = label;
+  }
+
+  int64_t length = (int64_t)high - low + 1;
+  if (length <= 0 || length > (int64_t)table->cases.count * DENSE_SWITCH_GAPS)
+    return;
+
+  int* offsets = ALLOCATE(int, length);
+  for (int i = 0; i < length; i++) offsets[i] = -1;
+  for (int i = 0; i < table->cases.capacity; i++) {
+    Entry* entry = &table->cases.entries[i];
+    if (IS_EMPTY(entry->key)) continue;
+    offsets[(int32_t)AS_NUMBER(entry->key) - low] = AS_INT(entry->value);
+  }
+
+  freeTable(&table->cases);
+  table->low = low;
+  table->length = (int)length;
+  table->offsets = offsets;
+}
+
+// Runs of cases whose values are constants share one OP_SWITCH, which
+// jumps straight to the matching case or past the run. The value stays
+// on the stack either way until a case takes it.
 static void switchStatement() {
   consume(TOKEN_LEFT_PAREN, "Expect '(' after 'switch'.");
   expression();
   consume(TOKEN_RIGHT_PAREN, "Expect ')' after value.");
   consume(TOKEN_LEFT_BRACE, "Expect '{' before switch cases.");
 
+  int base = current->usage.delta - 1;
   int state = 0;
   int caseCount = 0;
   int caseCapacity = 0;
   int previousCaseSkip = -1;
   int* caseEnds = NULL;
+  int table = -1;
+  int dispatch = 0;
 
   while (!match(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF)) {
     if (match(TOKEN_CASE) || match(TOKEN_DEFAULT)) {
@@ -983,10 +1210,10 @@ static void switchStatement() {
         error("Can't have another case or default after the default case.");
       if (state == 1) {
         caseEnds[caseCount++] = emitJump(OP_JUMP);
-        patchJump(previousCaseSkip);
-        current->usage.delta++;
-        emitOp(OP_POP);
+        if (previousCaseSkip != -1) patchJump(previousCaseSkip);
       }
+      current->usage.delta = base + 1;
+
       if (caseType == TOKEN_CASE) {
         if (caseCount == caseCapacity) {
           int oldCapacity = caseCapacity;
@@ -995,17 +1222,44 @@ static void switchStatement() {
           caseEnds = GROW_ARRAY(int, caseEnds, oldCapacity, caseCapacity);
         }
         state = 1;
+        int test = currentChunk()->count;
         emitOp(OP_DUP);
         expression();
         consume(TOKEN_COLON, "Expect ':' after case value.");
-        emitOp(OP_EQUAL);
-        previousCaseSkip = emitJump(OP_JUMP_IF_FALSE);
-        current->usage.delta += 2;
-        emitOp(OP_POP);
-        emitOp(OP_POP);
+
+        Value label;
+        if (constantSince(test + 1, &label)) {
+          push(label);
+          dropConstant(test + 1);
+          amendChunk(currentChunk(), currentChunk()->count - test);
+          current->constantEnd = -1;
+          current->usage.delta = base + 1;
+          if (table == -1) {
+            table = emitSwitch();
+            dispatch = currentChunk()->count;
+          }
+
+          Table* cases = &currentChunk()->switches[table].cases;
+          if (!tableGet(cases, label, NULL)) {
+            tableSet(cases, label, INT_VAL(currentChunk()->count - dispatch));
+            writeBarrier(&current->function->obj, label);
+          }
+          pop();
+          previousCaseSkip = -1;
+          emitOp(OP_POP);
+        } else {
+          if (table != -1) finishSwitch(table, test - dispatch);
+          table = -1;
+          emitOp(OP_EQUAL);
+          previousCaseSkip = emitJump(OP_POP_JUMP_IF_FALSE);
+          emitOp(OP_POP);
+        }
       } else {
         state = 2;
         consume(TOKEN_COLON, "Expect ':' after default.");
+        if (table != -1)
+          finishSwitch(table, currentChunk()->count - dispatch);
+        table = -1;
         previousCaseSkip = -1;
         emitOp(OP_POP);
       }
@@ -1016,11 +1270,16 @@ static void switchStatement() {
   }
   if (state == 1) {
     caseEnds[caseCount++] = emitJump(OP_JUMP);
-    patchJump(previousCaseSkip);
+    if (previousCaseSkip != -1) patchJump(previousCaseSkip);
+  }
+  if (table != -1) finishSwitch(table, currentChunk()->count - dispatch);
+  if (state < 2) {
+    current->usage.delta = base + 1;
+    emitOp(OP_POP);
   }
-  if (state < 2) emitOp(OP_POP);
   for (int i = 0; i < caseCount; i++) patchJump(caseEnds[i]);
-  FREE_ARRAY(int*, caseEnds, caseCapacity);
+  current->usage.delta = base;
+  FREE_ARRAY(int, caseEnds, caseCapacity);
 }
 
 static void printStatement() {
@@ -1058,13 +1317,11 @@ static void whileStatement() {
   expression();
   consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
 
-  int exitJump = emitJump(OP_JUMP_IF_FALSE);
-  emitOp(OP_POP);
+  int exitJump = emitJump(OP_POP_JUMP_IF_FALSE);
   statement();
   emitLoop(current->innermostLoopStart);
 
   patchJump(exitJump);
-  emitOp(OP_POP);
 
   current->innermostLoopStart = surroundingLoopStart;
   current->innermostLoopScopeDepth = surroundingLoopScopeDepth;
@@ -1140,8 +1397,8 @@ static void statement() {
   }
 }
 
-ObjFunction* compile(const char* source) {
-  initScanner(source);
+ObjFunction* compile(const char* source, size_t length) {
+  initScanner(source, length);
   Compiler compiler;
   initCompiler(&compiler, TYPE_SCRIPT);
 
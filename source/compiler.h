@@ -3,7 +3,7 @@
 
 #include "object.h"
 
-ObjFunction* compile(const char* source);
+ObjFunction* compile(const char* source, size_t length);
 void markCompilerRoots();
 
 #endif
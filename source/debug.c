@@ -114,6 +114,19 @@ char* getOpName(OpCode op) {
     case OP_LESS_EQUAL: return "OP_LESS_EQUAL";
     case OP_GET_THIS: return "OP_GET_THIS";
     case OP_DUP: return "OP_DUP";
+    case OP_ADD_NUM: return "OP_ADD_NUM";
+    case OP_ADD_STR: return "OP_ADD_STR";
+    case OP_EQUAL_NUM: return "OP_EQUAL_NUM";
+    case OP_NOT_EQUAL_NUM: return "OP_NOT_EQUAL_NUM";
+    case OP_BUILD_STRING: return "OP_BUILD_STRING";
+    case OP_SWITCH: return "OP_SWITCH";
+    case OP_POP_JUMP_IF_FALSE: return "OP_POP_JUMP_IF_FALSE";
+    case OP_JUMP_IF_NOT_EQUAL: return "OP_JUMP_IF_NOT_EQUAL";
+    case OP_JUMP_IF_EQUAL: return "OP_JUMP_IF_EQUAL";
+    case OP_JUMP_IF_NOT_GREATER: return "OP_JUMP_IF_NOT_GREATER";
+    case OP_JUMP_IF_NOT_GREATER_EQUAL: return "OP_JUMP_IF_NOT_GREATER_EQUAL";
+    case OP_JUMP_IF_NOT_LESS: return "OP_JUMP_IF_NOT_LESS";
+    case OP_JUMP_IF_NOT_LESS_EQUAL: return "OP_JUMP_IF_NOT_LESS_EQUAL";
   }
   return NULL;
 }
@@ -145,10 +158,20 @@ static int globalInstr(OpCode op, Chunk* chunk, int offset) {
 static int invokeInstr(OpCode op, Chunk* chunk, int offset) {
   uint16_t constant = chunk->code[offset + 1] | chunk->code[offset + 2] << 8;
   uint8_t argCount = chunk->code[offset + 3];
+  uint16_t callsite = chunk->code[offset + 4] | chunk->code[offset + 5] << 8;
   printf("%-16s %5d '", getOpName(op), constant);
   printValue(chunk->constants.values[constant]);
-  printf("' (%d args)\n", argCount);
-  return offset + 4;
+  printf("' (%d args) #%d\n", argCount, callsite);
+  return offset + 6;
+}
+
+static int propertyInstr(OpCode op, Chunk* chunk, int offset) {
+  uint16_t constant = chunk->code[offset + 1] | chunk->code[offset + 2] << 8;
+  uint16_t cache = chunk->code[offset + 3] | chunk->code[offset + 4] << 8;
+  printf("%-16s %5d '", getOpName(op), constant);
+  printValue(chunk->constants.values[constant]);
+  printf("' #%d\n", cache);
+  return offset + 5;
 }
 
 static int simpleInstr(OpCode op, int offset) {
@@ -169,6 +192,19 @@ static int jumpInstr(OpCode op, int sign, Chunk* chunk, int offset) {
   return offset + 3;
 }
 
+static int switchInstr(OpCode op, Chunk* chunk, int offset) {
+  uint16_t index = chunk->code[offset + 1] | chunk->code[offset + 2] << 8;
+  SwitchTable* table = &chunk->switches[index];
+  printf("%-16s %5d", getOpName(op), index);
+  if (table->offsets != NULL) {
+    printf(" [%d, %d]", table->low, table->low + table->length - 1);
+  } else {
+    printf(" {%d}", table->cases.count);
+  }
+  printf(" else -> %d\n", offset + 3 + table->miss);
+  return offset + 3;
+}
+
 int disassembleInstr(Chunk* chunk, int offset) {
   printf("%04d ", offset);
   int line = getLine(chunk, offset);
@@ -192,8 +228,8 @@ int disassembleInstr(Chunk* chunk, int offset) {
     case OP_SET_GLOBAL: return globalInstr(opcode, chunk, offset);
     case OP_GET_UPVALUE: return byteInstr(opcode, chunk, offset);
     case OP_SET_UPVALUE: return byteInstr(opcode, chunk, offset);
-    case OP_GET_PROPERTY: return constantInstr(opcode, chunk, offset);
-    case OP_SET_PROPERTY: return constantInstr(opcode, chunk, offset);
+    case OP_GET_PROPERTY: return propertyInstr(opcode, chunk, offset);
+    case OP_SET_PROPERTY: return propertyInstr(opcode, chunk, offset);
     case OP_GET_SUPER: return constantInstr(opcode, chunk, offset);
     case OP_EQUAL: return simpleInstr(opcode, offset);
     case OP_GREATER: return simpleInstr(opcode, offset);
@@ -250,6 +286,20 @@ int disassembleInstr(Chunk* chunk, int offset) {
     case OP_LESS_EQUAL: return simpleInstr(opcode, offset);
     case OP_GET_THIS: return simpleInstr(opcode, offset);
     case OP_DUP: return simpleInstr(opcode, offset);
+    case OP_ADD_NUM: return simpleInstr(opcode, offset);
+    case OP_ADD_STR: return simpleInstr(opcode, offset);
+    case OP_EQUAL_NUM: return simpleInstr(opcode, offset);
+    case OP_NOT_EQUAL_NUM: return simpleInstr(opcode, offset);
+    case OP_BUILD_STRING: return byteInstr(opcode, chunk, offset);
+    case OP_SWITCH: return switchInstr(opcode, chunk, offset);
+    case OP_POP_JUMP_IF_FALSE:
+    case OP_JUMP_IF_NOT_EQUAL:
+    case OP_JUMP_IF_EQUAL:
+    case OP_JUMP_IF_NOT_GREATER:
+    case OP_JUMP_IF_NOT_GREATER_EQUAL:
+    case OP_JUMP_IF_NOT_LESS:
+    case OP_JUMP_IF_NOT_LESS_EQUAL:
+      return jumpInstr(opcode, 1, chunk, offset);
   }
   printf("Unknown opcode %d\n", opcode);
   return offset + 1;
@@ -272,3 +322,32 @@ void printTable(Table* table) {
     }
   }
 }
+
+#ifdef DEBUG_LOG_CACHE
+static void printRate(const char* kind, int index, int hits, int misses) {
+  int total = hits + misses;
+  printf("%-8s #%-5d %10d hits %10d misses", kind, index, hits, misses);
+  if (total > 0) printf(" (%5.1f%%)", 100.0 * hits / total);
+}
+
+void printCaches(Chunk* chunk, const char* name) {
+  if (chunk->callsiteCount == 0 && chunk->cacheCount == 0) return;
+  printf("== %s caches ==\n", name);
+
+  for (int i = 0; i < chunk->callsiteCount; i++) {
+    Callsite* callsite = &chunk->callsites[i];
+    printRate("invoke", i, callsite->hits, callsite->misses);
+    if (callsite->megamorphic) {
+      printf(" megamorphic\n");
+    } else {
+      printf(" %d of %d entries\n", callsite->count, CALLSITE_ENTRIES);
+    }
+  }
+
+  for (int i = 0; i < chunk->cacheCount; i++) {
+    PropertyCache* cache = &chunk->caches[i];
+    printRate("property", i, cache->hits, cache->misses);
+    printf("\n");
+  }
+}
+#endif
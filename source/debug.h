@@ -10,5 +10,8 @@ char* getOpName(OpCode op);
 void disassembleChunk(Chunk* chunk, const char* name);
 int disassembleInstr(Chunk* chunk, int offset);
 void printTable(Table* table);
+#ifdef DEBUG_LOG_CACHE
+void printCaches(Chunk* chunk, const char* name);
+#endif
 
 #endif
@@ -0,0 +1,335 @@
+#include "dtoa.h"
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SIGNIFICAND_MASK ((uint64_t)0x000FFFFFFFFFFFFF)
+#define HIDDEN_BIT ((uint64_t)0x0010000000000000)
+#define DENORMAL_EXPONENT -1074
+#define EXPONENT_BIAS 1075
+#define MIN_TARGET_EXPONENT -60
+#define CACHED_POWERS_OFFSET 348
+#define CACHED_POWERS_DISTANCE 8
+#define D_1_LOG2_10 0.30102999566398114
+#define SCIENTIFIC_MIN -4
+#define SCIENTIFIC_MAX 21
+
+typedef struct {
+  uint64_t f;
+  int e;
+} DiyFp;
+
+typedef struct {
+  uint64_t f;
+  int16_t e;
+  int16_t k;
+} CachedPower;
+
+static const CachedPower cachedPowers[] = {
+    {0xFA8FD5A0081C0288, -1220, -348},
+    {0xBAAEE17FA23EBF76, -1193, -340},
+    {0x8B16FB203055AC76, -1166, -332},
+    {0xCF42894A5DCE35EA, -1140, -324},
+    {0x9A6BB0AA55653B2D, -1113, -316},
+    {0xE61ACF033D1A45DF, -1087, -308},
+    {0xAB70FE17C79AC6CA, -1060, -300},
+    {0xFF77B1FCBEBCDC4F, -1034, -292},
+    {0xBE5691EF416BD60C, -1007, -284},
+    {0x8DD01FAD907FFC3C, -980, -276},
+    {0xD3515C2831559A83, -954, -268},
+    {0x9D71AC8FADA6C9B5, -927, -260},
+    {0xEA9C227723EE8BCB, -901, -252},
+    {0xAECC49914078536D, -874, -244},
+    {0x823C12795DB6CE57, -847, -236},
+    {0xC21094364DFB5637, -821, -228},
+    {0x9096EA6F3848984F, -794, -220},
+    {0xD77485CB25823AC7, -768, -212},
+    {0xA086CFCD97BF97F4, -741, -204},
+    {0xEF340A98172AACE5, -715, -196},
+    {0xB23867FB2A35B28E, -688, -188},
+    {0x84C8D4DFD2C63F3B, -661, -180},
+    {0xC5DD44271AD3CDBA, -635, -172},
+    {0x936B9FCEBB25C996, -608, -164},
+    {0xDBAC6C247D62A584, -582, -156},
+    {0xA3AB66580D5FDAF6, -555, -148},
+    {0xF3E2F893DEC3F126, -529, -140},
+    {0xB5B5ADA8AAFF80B8, -502, -132},
+    {0x87625F056C7C4A8B, -475, -124},
+    {0xC9BCFF6034C13053, -449, -116},
+    {0x964E858C91BA2655, -422, -108},
+    {0xDFF9772470297EBD, -396, -100},
+    {0xA6DFBD9FB8E5B88F, -369, -92},
+    {0xF8A95FCF88747D94, -343, -84},
+    {0xB94470938FA89BCF, -316, -76},
+    {0x8A08F0F8BF0F156B, -289, -68},
+    {0xCDB02555653131B6, -263, -60},
+    {0x993FE2C6D07B7FAC, -236, -52},
+    {0xE45C10C42A2B3B06, -210, -44},
+    {0xAA242499697392D3, -183, -36},
+    {0xFD87B5F28300CA0E, -157, -28},
+    {0xBCE5086492111AEB, -130, -20},
+    {0x8CBCCC096F5088CC, -103, -12},
+    {0xD1B71758E219652C, -77, -4},
+    {0x9C40000000000000, -50, 4},
+    {0xE8D4A51000000000, -24, 12},
+    {0xAD78EBC5AC620000, 3, 20},
+    {0x813F3978F8940984, 30, 28},
+    {0xC097CE7BC90715B3, 56, 36},
+    {0x8F7E32CE7BEA5C70, 83, 44},
+    {0xD5D238A4ABE98068, 109, 52},
+    {0x9F4F2726179A2245, 136, 60},
+    {0xED63A231D4C4FB27, 162, 68},
+    {0xB0DE65388CC8ADA8, 189, 76},
+    {0x83C7088E1AAB65DB, 216, 84},
+    {0xC45D1DF942711D9A, 242, 92},
+    {0x924D692CA61BE758, 269, 100},
+    {0xDA01EE641A708DEA, 295, 108},
+    {0xA26DA3999AEF774A, 322, 116},
+    {0xF209787BB47D6B85, 348, 124},
+    {0xB454E4A179DD1877, 375, 132},
+    {0x865B86925B9BC5C2, 402, 140},
+    {0xC83553C5C8965D3D, 428, 148},
+    {0x952AB45CFA97A0B3, 455, 156},
+    {0xDE469FBD99A05FE3, 481, 164},
+    {0xA59BC234DB398C25, 508, 172},
+    {0xF6C69A72A3989F5C, 534, 180},
+    {0xB7DCBF5354E9BECE, 561, 188},
+    {0x88FCF317F22241E2, 588, 196},
+    {0xCC20CE9BD35C78A5, 614, 204},
+    {0x98165AF37B2153DF, 641, 212},
+    {0xE2A0B5DC971F303A, 667, 220},
+    {0xA8D9D1535CE3B396, 694, 228},
+    {0xFB9B7CD9A4A7443C, 720, 236},
+    {0xBB764C4CA7A44410, 747, 244},
+    {0x8BAB8EEFB6409C1A, 774, 252},
+    {0xD01FEF10A657842C, 800, 260},
+    {0x9B10A4E5E9913129, 827, 268},
+    {0xE7109BFBA19C0C9D, 853, 276},
+    {0xAC2820D9623BF429, 880, 284},
+    {0x80444B5E7AA7CF85, 907, 292},
+    {0xBF21E44003ACDD2D, 933, 300},
+    {0x8E679C2F5E44FF8F, 960, 308},
+    {0xD433179D9C8CB841, 986, 316},
+    {0x9E19DB92B4E31BA9, 1013, 324},
+    {0xEB96BF6EBADF77D9, 1039, 332},
+    {0xAF87023B9BF0EE6B, 1066, 340}
+};
+
+static const uint32_t smallPowers[] = {
+    0,      1,       10,       100,       1000,      10000,
+    100000, 1000000, 10000000, 100000000, 1000000000};
+
+static DiyFp multiply(DiyFp x, DiyFp y) {
+  uint64_t a = x.f >> 32, b = x.f & 0xFFFFFFFF;
+  uint64_t c = y.f >> 32, d = y.f & 0xFFFFFFFF;
+  uint64_t ac = a * c, bc = b * c, ad = a * d, bd = b * d;
+  uint64_t middle = (bd >> 32) + (ad & 0xFFFFFFFF) + (bc & 0xFFFFFFFF);
+  middle += 1U << 31;
+  uint64_t f = ac + (ad >> 32) + (bc >> 32) + (middle >> 32);
+  return (DiyFp){f, x.e + y.e + 64};
+}
+
+static DiyFp normalize(DiyFp x) {
+  while (!(x.f & 0xFFC0000000000000)) {
+    x.f <<= 10;
+    x.e -= 10;
+  }
+  while (!(x.f & 0x8000000000000000)) {
+    x.f <<= 1;
+    x.e--;
+  }
+  return x;
+}
+
+static CachedPower cachedPower(int exponent) {
+  int minExponent = MIN_TARGET_EXPONENT - (exponent + 64);
+  int k = (int)ceil((minExponent + 63) * D_1_LOG2_10);
+  int index = (CACHED_POWERS_OFFSET + k - 1) / CACHED_POWERS_DISTANCE + 1;
+  return cachedPowers[index];
+}
+
+static bool roundWeed(
+    char* digits, int length, uint64_t distance, uint64_t unsafe,
+    uint64_t rest, uint64_t tenKappa, uint64_t unit) {
+  uint64_t small = distance - unit;
+  uint64_t big = distance + unit;
+
+  while (rest < small && unsafe - rest >= tenKappa &&
+         (rest + tenKappa < small ||
+          small - rest >= rest + tenKappa - small)) {
+    digits[length - 1]--;
+    rest += tenKappa;
+  }
+
+  if (rest < big && unsafe - rest >= tenKappa &&
+      (rest + tenKappa < big || big - rest > rest + tenKappa - big))
+    return false;
+
+  return 2 * unit <= rest && rest <= unsafe - 4 * unit;
+}
+
+static bool generateDigits(
+    DiyFp low, DiyFp w, DiyFp high, char* digits, int* length, int* kappa) {
+  uint64_t unit = 1;
+  uint64_t tooHigh = high.f + unit;
+  uint64_t unsafe = tooHigh - (low.f - unit);
+  int shift = -w.e;
+  uint64_t one = (uint64_t)1 << shift;
+  uint32_t integrals = (uint32_t)(tooHigh >> shift);
+  uint64_t fractionals = tooHigh & (one - 1);
+
+  int power = 10;
+  while (integrals < smallPowers[power]) power--;
+  uint32_t divisor = smallPowers[power];
+  *kappa = power;
+  *length = 0;
+
+  while (*kappa > 0) {
+    digits[(*length)++] = '0' + integrals / divisor;
+    integrals %= divisor;
+    (*kappa)--;
+    uint64_t rest = ((uint64_t)integrals << shift) + fractionals;
+    if (rest < unsafe) {
+      return roundWeed(
+          digits, *length, tooHigh - w.f, unsafe, rest,
+          (uint64_t)divisor << shift, unit);
+    }
+    divisor /= 10;
+  }
+
+  for (;;) {
+    fractionals *= 10;
+    unit *= 10;
+    unsafe *= 10;
+    digits[(*length)++] = '0' + (int)(fractionals >> shift);
+    fractionals &= one - 1;
+    (*kappa)--;
+    if (fractionals < unsafe) {
+      return roundWeed(
+          digits, *length, (tooHigh - w.f) * unit, unsafe, fractionals, one,
+          unit);
+    }
+  }
+}
+
+// Grisu3 (Loitsch, "Printing Floating-Point Numbers Quickly and Accurately
+// with Integers"). Fails for the rare inputs it cannot prove shortest.
+static bool grisu3(double number, char* digits, int* length, int* exponent) {
+  uint64_t bits;
+  memcpy(&bits, &number, sizeof(bits));
+  int biased = (int)(bits >> 52) & 0x7FF;
+  DiyFp v = biased == 0
+                ? (DiyFp){bits & SIGNIFICAND_MASK, DENORMAL_EXPONENT}
+                : (DiyFp){(bits & SIGNIFICAND_MASK) | HIDDEN_BIT,
+                          biased - EXPONENT_BIAS};
+
+  DiyFp plus = normalize((DiyFp){(v.f << 1) + 1, v.e - 1});
+  bool closer = (bits & SIGNIFICAND_MASK) == 0 && biased > 1;
+  DiyFp minus = closer ? (DiyFp){(v.f << 2) - 1, v.e - 2}
+                       : (DiyFp){(v.f << 1) - 1, v.e - 1};
+  minus.f <<= minus.e - plus.e;
+  minus.e = plus.e;
+  DiyFp w = normalize(v);
+
+  CachedPower power = cachedPower(w.e);
+  DiyFp scale = {power.f, power.e};
+  int kappa;
+  bool exact = generateDigits(
+      multiply(minus, scale), multiply(w, scale), multiply(plus, scale),
+      digits, length, &kappa);
+  *exponent = kappa - power.k;
+  return exact;
+}
+
+static void roundTripDigits(
+    double number, char* digits, int* length, int* exponent) {
+  char text[NUMBER_TEXT_MAX];
+  for (int precision = 15; precision <= 17; precision++) {
+    snprintf(text, sizeof(text), "%.*e", precision - 1, number);
+    if (strtod(text, NULL) == number) break;
+  }
+
+  char* c = text;
+  *length = 0;
+  for (; *c != 'e'; c++) {
+    if (*c != '.') digits[(*length)++] = *c;
+  }
+  while (*length > 1 && digits[*length - 1] == '0') (*length)--;
+  *exponent = atoi(c + 1) - *length + 1;
+}
+
+int integerToStr(char* buffer, int64_t number) {
+  char digits[20];
+  int count = 0;
+  uint64_t magnitude = number < 0 ? -(uint64_t)number : (uint64_t)number;
+  do {
+    digits[count++] = '0' + magnitude % 10;
+    magnitude /= 10;
+  } while (magnitude != 0);
+
+  int length = 0;
+  if (number < 0) buffer[length++] = '-';
+  while (count > 0) buffer[length++] = digits[--count];
+  buffer[length] = '\0';
+  return length;
+}
+
+static int layoutDigits(
+    char* buffer, bool negative, const char* digits, int count, int point) {
+  int length = 0;
+  if (negative) buffer[length++] = '-';
+
+  if (point < SCIENTIFIC_MIN || point >= SCIENTIFIC_MAX) {
+    buffer[length++] = digits[0];
+    if (count > 1) {
+      buffer[length++] = '.';
+      memcpy(buffer + length, digits + 1, count - 1);
+      length += count - 1;
+    }
+    return length + snprintf(buffer + length, NUMBER_TEXT_MAX - length,
+                             "e%c%02d", point < 0 ? '-' : '+', abs(point));
+  }
+
+  if (point < 0) {
+    buffer[length++] = '0';
+    buffer[length++] = '.';
+    for (int i = -1; i > point; i--) buffer[length++] = '0';
+    memcpy(buffer + length, digits, count);
+    length += count;
+  } else if (count <= point + 1) {
+    memcpy(buffer + length, digits, count);
+    length += count;
+    for (int i = count; i <= point; i++) buffer[length++] = '0';
+  } else {
+    memcpy(buffer + length, digits, point + 1);
+    length += point + 1;
+    buffer[length++] = '.';
+    memcpy(buffer + length, digits + point + 1, count - point - 1);
+    length += count - point - 1;
+  }
+
+  buffer[length] = '\0';
+  return length;
+}
+
+// Integers below 2^53 are exact, so their digits are already the shortest
+// ones that read back. Everything else goes through Grisu3 and is laid out
+// in positional notation from 1e-4 up to 1e21.
+int numberToStr(char* buffer, double number) {
+  if (number != 0 && number > -0x1p53 && number < 0x1p53 &&
+      (double)(int64_t)number == number)
+    return integerToStr(buffer, (int64_t)number);
+  if (number == 0 || !isfinite(number))
+    return snprintf(buffer, NUMBER_TEXT_MAX, "%g", number);
+
+  char digits[NUMBER_TEXT_MAX];
+  int count, exponent;
+  double magnitude = fabs(number);
+  if (!grisu3(magnitude, digits, &count, &exponent))
+    roundTripDigits(magnitude, digits, &count, &exponent);
+  return layoutDigits(
+      buffer, number < 0, digits, count, count + exponent - 1);
+}
@@ -0,0 +1,11 @@
+#ifndef CLOX_DTOA_H
+#define CLOX_DTOA_H
+
+#include "common.h"
+
+#define NUMBER_TEXT_MAX 32
+
+int integerToStr(char* buffer, int64_t number);
+int numberToStr(char* buffer, double number);
+
+#endif
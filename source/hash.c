@@ -0,0 +1,143 @@
+#include "hash.h"
+
+#include <string.h>
+
+#if defined(__AVX2__) && !defined(NO_SIMD)
+#define HASH_AVX2
+#include <immintrin.h>
+#elif defined(__SSE2__) && !defined(NO_SIMD)
+#define HASH_SSE2
+#include <emmintrin.h>
+#endif
+
+#define PRIME64_1 0x9E3779B185EBCA87
+#define PRIME64_2 0xC2B2AE3D27D4EB4F
+#define PRIME64_3 0x165667B19E3779F9
+#define PRIME64_4 0x85EBCA77C2B2AE63
+#define HASH_STRIPE 32
+
+static const uint64_t stripeKeys[4] = {
+    0xBE4BA423396CFEB8, 0x1CAD21F72C81017C, 0xDB979083E96DD4DE,
+    0x1F67B3B7A4A44072};
+
+static inline uint64_t readWord(const char* chars) {
+  uint64_t word;
+  memcpy(&word, chars, sizeof(word));
+  return word;
+}
+
+static inline uint64_t readPartial(const char* chars, int length) {
+  uint64_t word = 0;
+  memcpy(&word, chars, length);
+  return word;
+}
+
+static inline uint64_t rotate(uint64_t word, int bits) {
+  return (word << bits) | (word >> (64 - bits));
+}
+
+static inline uint64_t mixWord(uint64_t hash, uint64_t word) {
+  hash ^= rotate(word * PRIME64_2, 31) * PRIME64_1;
+  return rotate(hash, 27) * PRIME64_1 + PRIME64_4;
+}
+
+// Each stripe feeds four 64-bit lanes with lo32 * hi32 of the keyed word
+// plus the neighboring lane's raw word, so every kernel below produces
+// the same lanes.
+#if defined(HASH_AVX2)
+static void accumulate(uint64_t lanes[4], const char* chars, int stripes) {
+  __m256i acc = _mm256_loadu_si256((const __m256i*)lanes);
+  __m256i key = _mm256_loadu_si256((const __m256i*)stripeKeys);
+  for (int i = 0; i < stripes; i++) {
+    __m256i data = _mm256_loadu_si256((const __m256i*)(chars + i * 32));
+    __m256i mixed = _mm256_xor_si256(data, key);
+    __m256i high = _mm256_shuffle_epi32(mixed, _MM_SHUFFLE(0, 3, 0, 1));
+    __m256i swapped = _mm256_shuffle_epi32(data, _MM_SHUFFLE(1, 0, 3, 2));
+    acc = _mm256_add_epi64(acc, swapped);
+    acc = _mm256_add_epi64(acc, _mm256_mul_epu32(mixed, high));
+  }
+  _mm256_storeu_si256((__m256i*)lanes, acc);
+}
+#elif defined(HASH_SSE2)
+static inline __m128i accumulateHalf(__m128i acc, __m128i data, __m128i key) {
+  __m128i mixed = _mm_xor_si128(data, key);
+  __m128i high = _mm_shuffle_epi32(mixed, _MM_SHUFFLE(0, 3, 0, 1));
+  __m128i swapped = _mm_shuffle_epi32(data, _MM_SHUFFLE(1, 0, 3, 2));
+  acc = _mm_add_epi64(acc, swapped);
+  return _mm_add_epi64(acc, _mm_mul_epu32(mixed, high));
+}
+
+static void accumulate(uint64_t lanes[4], const char* chars, int stripes) {
+  __m128i low = _mm_loadu_si128((const __m128i*)lanes);
+  __m128i high = _mm_loadu_si128((const __m128i*)(lanes + 2));
+  __m128i lowKey = _mm_loadu_si128((const __m128i*)stripeKeys);
+  __m128i highKey = _mm_loadu_si128((const __m128i*)(stripeKeys + 2));
+  for (int i = 0; i < stripes; i++) {
+    const char* stripe = chars + i * HASH_STRIPE;
+    low = accumulateHalf(
+        low, _mm_loadu_si128((const __m128i*)stripe), lowKey);
+    high = accumulateHalf(
+        high, _mm_loadu_si128((const __m128i*)(stripe + 16)), highKey);
+  }
+  _mm_storeu_si128((__m128i*)lanes, low);
+  _mm_storeu_si128((__m128i*)(lanes + 2), high);
+}
+#else
+static void accumulate(uint64_t lanes[4], const char* chars, int stripes) {
+  for (int i = 0; i < stripes; i++) {
+    for (int lane = 0; lane < 4; lane++) {
+      uint64_t data = readWord(chars + i * HASH_STRIPE + lane * 8);
+      uint64_t mixed = data ^ stripeKeys[lane];
+      lanes[lane ^ 1] += data;
+      lanes[lane] += (mixed & 0xFFFFFFFF) * (mixed >> 32);
+    }
+  }
+}
+#endif
+
+uint32_t hashString(const char* key, int length) {
+  uint64_t hash = (uint64_t)length * PRIME64_1;
+
+  if (length >= HASH_STRIPE) {
+    uint64_t lanes[4] = {PRIME64_3, PRIME64_1, PRIME64_2, PRIME64_4};
+    int stripes = length / HASH_STRIPE;
+    accumulate(lanes, key, stripes);
+    for (int lane = 0; lane < 4; lane++) hash = mixWord(hash, lanes[lane]);
+    key += stripes * HASH_STRIPE;
+    length -= stripes * HASH_STRIPE;
+  }
+
+  for (; length >= 8; key += 8, length -= 8)
+    hash = mixWord(hash, readWord(key));
+  if (length > 0) hash = mixWord(hash, readPartial(key, length));
+
+  hash ^= hash >> 33;
+  hash *= PRIME64_2;
+  hash ^= hash >> 29;
+  hash *= PRIME64_3;
+  hash ^= hash >> 32;
+  return (uint32_t)hash;
+}
+
+bool charsEqual(const char* a, const char* b, int length) {
+#if defined(HASH_AVX2)
+  for (; length >= 32; a += 32, b += 32, length -= 32) {
+    __m256i equal = _mm256_cmpeq_epi8(
+        _mm256_loadu_si256((const __m256i*)a),
+        _mm256_loadu_si256((const __m256i*)b));
+    if ((uint32_t)_mm256_movemask_epi8(equal) != 0xFFFFFFFF) return false;
+  }
+#endif
+#if defined(HASH_AVX2) || defined(HASH_SSE2)
+  for (; length >= 16; a += 16, b += 16, length -= 16) {
+    __m128i equal = _mm_cmpeq_epi8(
+        _mm_loadu_si128((const __m128i*)a),
+        _mm_loadu_si128((const __m128i*)b));
+    if (_mm_movemask_epi8(equal) != 0xFFFF) return false;
+  }
+#endif
+  for (; length >= 8; a += 8, b += 8, length -= 8) {
+    if (readWord(a) != readWord(b)) return false;
+  }
+  return length == 0 || readPartial(a, length) == readPartial(b, length);
+}
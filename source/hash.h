@@ -0,0 +1,9 @@
+#ifndef CLOX_HASH_H
+#define CLOX_HASH_H
+
+#include "common.h"
+
+uint32_t hashString(const char* key, int length);
+bool charsEqual(const char* a, const char* b, int length);
+
+#endif
@@ -0,0 +1,684 @@
+#include "image.h"
+
+#include "memory.h"
+#include "native.h"
+#include "serialize.h"
+#include "vm.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define IMAGE_MAGIC "LOXI"
+#define IMAGE_VERSION 4
+#define IMAGE_MAX_LOAD 0.5
+
+typedef enum {
+  VALUE_NIL,
+  VALUE_FALSE,
+  VALUE_TRUE,
+  VALUE_UNDEFINED,
+  VALUE_INT,
+  VALUE_DOUBLE,
+  VALUE_SMALL_STRING,
+  VALUE_OBJECT
+} ValueTag;
+
+// Native functions are saved as their position here since their
+// addresses change from one process to the next.
+static const NativeFn natives[] = {
+    clockNative,    strNative,      hashNative,       hasFieldNative,
+    getFieldNative, setFieldNative, deleteFieldNative};
+
+#define NATIVE_COUNT (int)(sizeof(natives) / sizeof(natives[0]))
+
+// Every object reachable from the globals, numbered in the order the
+// loader creates them.
+typedef struct {
+  Obj** objects;
+  int count;
+  int capacity;
+  Obj** keys;
+  int* ids;
+  int keyCapacity;
+} ObjectIds;
+
+static void writeHeader(Writer* out) {
+  writeChars(out, IMAGE_MAGIC, (int)strlen(IMAGE_MAGIC));
+  writeInt(out, IMAGE_VERSION);
+  writeInt(out, (int32_t)sizeof(Value));
+  writeInt(out, SMALL_STRING_MAX);
+  writeInt(out, OP_JUMP_IF_NOT_LESS_EQUAL + 1);
+}
+
+// The loader can only create an object once everything its constructor
+// needs exists: closures need their function and instances their class.
+// Ropes are saved as the strings they spell.
+static int creationRank(ObjType type) {
+  switch (type) {
+    case OBJ_ROPE:
+    case OBJ_STRING: return 0;
+    case OBJ_NATIVE: return 1;
+    case OBJ_FUNCTION: return 2;
+    case OBJ_UPVALUE: return 3;
+    case OBJ_SHAPE: return 4;
+    case OBJ_CLASS: return 5;
+    case OBJ_CLOSURE: return 6;
+    case OBJ_INSTANCE: return 7;
+    case OBJ_BOUND_METHOD: return 8;
+  }
+  return 0;
+}
+
+#define CREATION_RANKS 9
+
+static int findKey(ObjectIds* ids, Obj* object) {
+  uint32_t mask = ids->keyCapacity - 1;
+  uint32_t index = (uint32_t)(((uintptr_t)object >> 3) * 2654435761u);
+  for (index &= mask;; index = (index + 1) & mask) {
+    if (ids->keys[index] == object || ids->keys[index] == NULL) return index;
+  }
+}
+
+static int idOf(ObjectIds* ids, Obj* object) {
+  return ids->ids[findKey(ids, object)];
+}
+
+static void growIds(ObjectIds* ids) {
+  Obj** keys = ids->keys;
+  int* values = ids->ids;
+  int capacity = ids->keyCapacity;
+
+  ids->keyCapacity = GROW_CAPACITY(capacity);
+  ids->keys = (Obj**)calloc(ids->keyCapacity, sizeof(Obj*));
+  ids->ids = (int*)malloc(sizeof(int) * ids->keyCapacity);
+  if (ids->keys == NULL || ids->ids == NULL) exit(1);
+
+  for (int i = 0; i < capacity; i++) {
+    if (keys[i] == NULL) continue;
+    int key = findKey(ids, keys[i]);
+    ids->keys[key] = keys[i];
+    ids->ids[key] = values[i];
+  }
+  free(keys);
+  free(values);
+}
+
+static void addObject(ObjectIds* ids, Obj* object) {
+  if (object == NULL) return;
+  if (ids->count + 1 > ids->keyCapacity * IMAGE_MAX_LOAD) growIds(ids);
+
+  int key = findKey(ids, object);
+  if (ids->keys[key] != NULL) return;
+
+  if (ids->count == ids->capacity) {
+    ids->capacity = GROW_CAPACITY(ids->capacity);
+    ids->objects =
+        (Obj**)realloc(ids->objects, sizeof(Obj*) * ids->capacity);
+    if (ids->objects == NULL) exit(1);
+  }
+  ids->keys[key] = object;
+  ids->ids[key] = ids->count;
+  ids->objects[ids->count++] = object;
+}
+
+static void addValue(ObjectIds* ids, Value value) {
+  if (IS_OBJ(value)) addObject(ids, AS_OBJ(value));
+}
+
+static void addTable(ObjectIds* ids, Table* table) {
+  for (int i = 0; i < table->capacity; i++) {
+    Entry* entry = &table->entries[i];
+    if (IS_EMPTY(entry->key)) continue;
+    addValue(ids, entry->key);
+    addValue(ids, entry->value);
+  }
+}
+
+static void addReferences(ObjectIds* ids, Obj* object) {
+  switch (object->type) {
+    case OBJ_BOUND_METHOD: {
+      ObjBoundMethod* bound = (ObjBoundMethod*)object;
+      addValue(ids, bound->receiver);
+      addObject(ids, (Obj*)bound->method);
+      break;
+    }
+    case OBJ_CLASS: {
+      ObjClass* klass = (ObjClass*)object;
+      addObject(ids, (Obj*)klass->name);
+      addValue(ids, klass->initializer);
+      addTable(ids, &klass->methods);
+      addObject(ids, (Obj*)klass->shape);
+      break;
+    }
+    case OBJ_CLOSURE: {
+      ObjClosure* closure = (ObjClosure*)object;
+      addObject(ids, (Obj*)closure->function);
+      for (int i = 0; i < closure->upvalueCount; i++)
+        addObject(ids, (Obj*)closure->upvalues[i]);
+      break;
+    }
+    case OBJ_FUNCTION: {
+      ObjFunction* function = (ObjFunction*)object;
+      addObject(ids, (Obj*)function->name);
+      for (int i = 0; i < function->chunk.constants.count; i++)
+        addValue(ids, function->chunk.constants.values[i]);
+      for (int i = 0; i < function->chunk.switchCount; i++)
+        addTable(ids, &function->chunk.switches[i].cases);
+      break;
+    }
+    case OBJ_INSTANCE: {
+      ObjInstance* instance = (ObjInstance*)object;
+      addObject(ids, (Obj*)instance->klass);
+      if (instance->shape != NULL) {
+        addObject(ids, (Obj*)instance->shape);
+        for (int i = 0; i < instance->shape->slotCount; i++)
+          addValue(ids, instance->slots[i]);
+      } else {
+        addTable(ids, instance->fields);
+      }
+      break;
+    }
+    case OBJ_SHAPE: {
+      ObjShape* shape = (ObjShape*)object;
+      addObject(ids, (Obj*)shape->parent);
+      addTable(ids, &shape->slots);
+      addTable(ids, &shape->transitions);
+      break;
+    }
+    case OBJ_UPVALUE: addValue(ids, ((ObjUpvalue*)object)->closed); break;
+    case OBJ_NATIVE:
+    case OBJ_ROPE:
+    case OBJ_STRING: break;
+  }
+}
+
+static void numberObjects(ObjectIds* ids) {
+  for (int i = 0; i < vm.globalValues.count; i++)
+    addValue(ids, vm.globalValues.values[i]);
+  for (int i = 0; i < ids->count; i++) addReferences(ids, ids->objects[i]);
+
+  int starts[CREATION_RANKS + 1] = {0};
+  for (int i = 0; i < ids->count; i++)
+    starts[creationRank(ids->objects[i]->type) + 1]++;
+  for (int i = 0; i < CREATION_RANKS; i++) starts[i + 1] += starts[i];
+
+  Obj** sorted = (Obj**)malloc(sizeof(Obj*) * (ids->count + 1));
+  if (sorted == NULL) exit(1);
+  for (int i = 0; i < ids->count; i++) {
+    Obj* object = ids->objects[i];
+    int id = starts[creationRank(object->type)]++;
+    sorted[id] = object;
+    ids->ids[findKey(ids, object)] = id;
+  }
+
+  free(ids->objects);
+  ids->objects = sorted;
+  ids->capacity = ids->count + 1;
+}
+
+static void writeImageValue(Writer* out, ObjectIds* ids, Value value) {
+  if (IS_NIL(value)) {
+    writeByte(out, VALUE_NIL);
+  } else if (IS_BOOL(value)) {
+    writeByte(out, AS_BOOL(value) ? VALUE_TRUE : VALUE_FALSE);
+  } else if (IS_UNDEFINED(value)) {
+    writeByte(out, VALUE_UNDEFINED);
+  } else if (IS_INT(value)) {
+    writeByte(out, VALUE_INT);
+    writeInt(out, AS_INT(value));
+  } else if (IS_NUMBER(value)) {
+    double number = AS_NUMBER(value);
+    writeByte(out, VALUE_DOUBLE);
+    writeChars(out, (const char*)&number, sizeof(number));
+#ifdef NAN_BOXING
+  } else if (IS_SMALL_STRING(value)) {
+    char chars[sizeof(Value)];
+    smallStringChars(value, chars);
+    writeByte(out, VALUE_SMALL_STRING);
+    writeCounted(out, chars, SMALL_STRING_LENGTH(value));
+#endif
+  } else {
+    writeByte(out, VALUE_OBJECT);
+    writeInt(out, idOf(ids, AS_OBJ(value)));
+  }
+}
+
+static void writeImageObject(Writer* out, ObjectIds* ids, Obj* object) {
+  if (object == NULL)
+    writeImageValue(out, ids, NIL_VAL);
+  else
+    writeImageValue(out, ids, OBJ_VAL(object));
+}
+
+static void writeImageTable(Writer* out, ObjectIds* ids, Table* table) {
+  int count = 0;
+  for (int i = 0; i < table->capacity; i++)
+    if (!IS_EMPTY(table->entries[i].key)) count++;
+
+  writeInt(out, count);
+  for (int i = 0; i < table->capacity; i++) {
+    Entry* entry = &table->entries[i];
+    if (IS_EMPTY(entry->key)) continue;
+    writeImageValue(out, ids, entry->key);
+    writeImageValue(out, ids, entry->value);
+  }
+}
+
+// What the loader needs to allocate the object, before any of the
+// objects it refers to exist.
+static bool writeCreation(Writer* out, ObjectIds* ids, Obj* object) {
+  writeByte(out, object->type == OBJ_ROPE ? OBJ_STRING : object->type);
+  switch (object->type) {
+    case OBJ_CLASS: writeInt(out, ((ObjClass*)object)->instanceSlots); break;
+    case OBJ_CLOSURE: {
+      ObjClosure* closure = (ObjClosure*)object;
+      writeInt(out, idOf(ids, (Obj*)closure->function));
+      break;
+    }
+    case OBJ_FUNCTION: writeCode(out, (ObjFunction*)object); break;
+    case OBJ_INSTANCE: {
+      ObjInstance* instance = (ObjInstance*)object;
+      writeInt(out, idOf(ids, (Obj*)instance->klass));
+      break;
+    }
+    case OBJ_NATIVE: {
+      int index = 0;
+      while (index < NATIVE_COUNT &&
+             natives[index] != ((ObjNative*)object)->function)
+        index++;
+      if (index == NATIVE_COUNT) return false;
+      writeInt(out, index);
+      break;
+    }
+    case OBJ_ROPE: {
+      ObjRope* rope = (ObjRope*)object;
+      char* chars = (char*)malloc(rope->length);
+      if (chars == NULL) exit(1);
+      copyRope(rope, chars);
+      writeCounted(out, chars, rope->length);
+      free(chars);
+      break;
+    }
+    case OBJ_SHAPE: writeInt(out, ((ObjShape*)object)->slotCount); break;
+    case OBJ_STRING: {
+      ObjString* string = (ObjString*)object;
+      writeCounted(out, string->chars, string->length);
+      break;
+    }
+    case OBJ_UPVALUE: {
+      ObjUpvalue* upvalue = (ObjUpvalue*)object;
+      if (upvalue->location != &upvalue->closed) return false;
+      break;
+    }
+    case OBJ_BOUND_METHOD: break;
+  }
+  return true;
+}
+
+static void writeReferences(Writer* out, ObjectIds* ids, Obj* object) {
+  switch (object->type) {
+    case OBJ_BOUND_METHOD: {
+      ObjBoundMethod* bound = (ObjBoundMethod*)object;
+      writeImageValue(out, ids, bound->receiver);
+      writeImageObject(out, ids, (Obj*)bound->method);
+      break;
+    }
+    case OBJ_CLASS: {
+      ObjClass* klass = (ObjClass*)object;
+      writeImageObject(out, ids, (Obj*)klass->name);
+      writeImageValue(out, ids, klass->initializer);
+      writeImageObject(out, ids, (Obj*)klass->shape);
+      writeImageTable(out, ids, &klass->methods);
+      break;
+    }
+    case OBJ_CLOSURE: {
+      ObjClosure* closure = (ObjClosure*)object;
+      for (int i = 0; i < closure->upvalueCount; i++)
+        writeImageObject(out, ids, (Obj*)closure->upvalues[i]);
+      break;
+    }
+    case OBJ_FUNCTION: {
+      ObjFunction* function = (ObjFunction*)object;
+      ValueArray* constants = &function->chunk.constants;
+      writeImageObject(out, ids, (Obj*)function->name);
+      writeInt(out, constants->count);
+      for (int i = 0; i < constants->count; i++)
+        writeImageValue(out, ids, constants->values[i]);
+      for (int i = 0; i < function->chunk.switchCount; i++)
+        writeImageTable(out, ids, &function->chunk.switches[i].cases);
+      break;
+    }
+    case OBJ_INSTANCE: {
+      ObjInstance* instance = (ObjInstance*)object;
+      writeImageObject(out, ids, (Obj*)instance->shape);
+      if (instance->shape != NULL) {
+        for (int i = 0; i < instance->shape->slotCount; i++)
+          writeImageValue(out, ids, instance->slots[i]);
+      } else {
+        writeImageTable(out, ids, instance->fields);
+      }
+      break;
+    }
+    case OBJ_SHAPE: {
+      ObjShape* shape = (ObjShape*)object;
+      writeImageObject(out, ids, (Obj*)shape->parent);
+      writeImageTable(out, ids, &shape->slots);
+      writeImageTable(out, ids, &shape->transitions);
+      break;
+    }
+    case OBJ_UPVALUE:
+      writeImageValue(out, ids, ((ObjUpvalue*)object)->closed);
+      break;
+    case OBJ_NATIVE:
+    case OBJ_ROPE:
+    case OBJ_STRING: break;
+  }
+}
+
+// Saves every object reachable from the globals. Objects are written
+// twice: once with what it takes to allocate them, then with their
+// references, so the loader can relocate cycles by object number.
+bool saveImage(const char* path) {
+  ObjectIds ids = {NULL, 0, 0, NULL, NULL, 0};
+  numberObjects(&ids);
+
+  Writer out;
+  initWriter(&out);
+  writeHeader(&out);
+  writeGlobalNames(&out);
+
+  bool saved = true;
+  writeInt(&out, ids.count);
+  for (int i = 0; i < ids.count && saved; i++)
+    saved = writeCreation(&out, &ids, ids.objects[i]);
+  for (int i = 0; i < ids.count; i++)
+    writeReferences(&out, &ids, ids.objects[i]);
+  for (int i = 0; i < vm.globalValues.count; i++)
+    writeImageValue(&out, &ids, vm.globalValues.values[i]);
+
+  if (saved) saved = saveFile(path, &out);
+  freeWriter(&out);
+  free(ids.objects);
+  free(ids.keys);
+  free(ids.ids);
+  return saved;
+}
+
+static Value readImageValue(Reader* in, ValueArray* objects) {
+  switch (readByte(in)) {
+    case VALUE_NIL: return NIL_VAL;
+    case VALUE_FALSE: return BOOL_VAL(false);
+    case VALUE_TRUE: return BOOL_VAL(true);
+    case VALUE_UNDEFINED: return UNDEFINED_VAL;
+    case VALUE_INT: return INT_VAL(readInt(in));
+    case VALUE_DOUBLE: {
+      double number = 0;
+      readBytes(in, &number, sizeof(number));
+      return NUMBER_VAL(number);
+    }
+#ifdef NAN_BOXING
+    case VALUE_SMALL_STRING: {
+      int length;
+      const char* chars = readCounted(in, &length);
+      if (chars != NULL && length <= SMALL_STRING_MAX)
+        return stringValue(chars, length);
+      break;
+    }
+#endif
+    case VALUE_OBJECT: {
+      int id = readInt(in);
+      if (id >= 0 && id < objects->count) return objects->values[id];
+      break;
+    }
+  }
+
+  in->failed = true;
+  return NIL_VAL;
+}
+
+// Reads a reference that must be nil or an object of the given type.
+static Obj* readImageObject(Reader* in, ValueArray* objects, ObjType type) {
+  Value value = readImageValue(in, objects);
+  if (IS_NIL(value)) return NULL;
+  if (!isObjType(value, type)) {
+    in->failed = true;
+    return NULL;
+  }
+  return AS_OBJ(value);
+}
+
+// Reads the number of an object that must already exist.
+static Obj* readId(Reader* in, ValueArray* objects, ObjType type) {
+  int id = readInt(in);
+  if (id < 0 || id >= objects->count ||
+      !isObjType(objects->values[id], type)) {
+    in->failed = true;
+    return NULL;
+  }
+  return AS_OBJ(objects->values[id]);
+}
+
+static void readImageTable(
+    Reader* in, ValueArray* objects, Table* table, Obj* owner) {
+  int count = readCount(in, remaining(in) / 2);
+  for (int i = 0; i < count && !in->failed; i++) {
+    Value key = readImageValue(in, objects);
+    Value value = readImageValue(in, objects);
+    tableSet(table, key, value);
+    writeBarrier(owner, key);
+    writeBarrier(owner, value);
+  }
+}
+
+// Each object is rooted as a constant of the holder as soon as it exists,
+// which also makes the holder's constants the table from object number
+// to object.
+static void readCreation(Reader* in, ObjFunction* holder) {
+  ValueArray* objects = &holder->chunk.constants;
+  Obj* object = NULL;
+  switch (readByte(in)) {
+    case OBJ_CLASS: {
+      int instanceSlots = readCount(in, UINT16_COUNT);
+      ObjClass* klass = newClass(NULL);
+      klass->instanceSlots = instanceSlots;
+      object = (Obj*)klass;
+      break;
+    }
+    case OBJ_CLOSURE: {
+      Obj* function = readId(in, objects, OBJ_FUNCTION);
+      if (function != NULL) object = (Obj*)newClosure((ObjFunction*)function);
+      break;
+    }
+    case OBJ_FUNCTION: {
+      ObjFunction* function = newFunction();
+      addConstant(&holder->chunk, OBJ_VAL(function));
+      writeBarrier(&holder->obj, OBJ_VAL(function));
+      readCode(in, function);
+      return;
+    }
+    case OBJ_INSTANCE: {
+      Obj* klass = readId(in, objects, OBJ_CLASS);
+      if (klass != NULL) object = (Obj*)newInstance((ObjClass*)klass);
+      break;
+    }
+    case OBJ_NATIVE: {
+      int index = readCount(in, NATIVE_COUNT - 1);
+      if (!in->failed) object = (Obj*)newNative(natives[index]);
+      break;
+    }
+    case OBJ_SHAPE: {
+      int slotCount = readCount(in, UINT16_COUNT);
+      ObjShape* shape = newShape(NULL);
+      shape->slotCount = slotCount;
+      object = (Obj*)shape;
+      break;
+    }
+    case OBJ_STRING: {
+      int length;
+      const char* chars = readCounted(in, &length);
+      if (chars != NULL) object = (Obj*)copyString(chars, length);
+      break;
+    }
+    case OBJ_UPVALUE: {
+      ObjUpvalue* upvalue = newUpvalue(NULL);
+      upvalue->location = &upvalue->closed;
+      object = (Obj*)upvalue;
+      break;
+    }
+    case OBJ_BOUND_METHOD: object = (Obj*)newBoundMethod(NIL_VAL, NULL); break;
+  }
+
+  if (object == NULL) {
+    in->failed = true;
+    return;
+  }
+  addConstant(&holder->chunk, OBJ_VAL(object));
+  writeBarrier(&holder->obj, OBJ_VAL(object));
+}
+
+static void readInstance(
+    Reader* in, ValueArray* objects, ObjInstance* instance) {
+  ObjShape* shape = (ObjShape*)readImageObject(in, objects, OBJ_SHAPE);
+  if (in->failed) return;
+
+  if (shape == NULL) {
+    Table* fields = ALLOCATE(Table, 1);
+    initTable(fields);
+    PUBLISH(instance->fields, fields);
+    PUBLISH(instance->shape, NULL);
+    readImageTable(in, objects, fields, &instance->obj);
+    return;
+  }
+
+  if (shape->slotCount > instance->slotCapacity) {
+    Value* slots = ALLOCATE(Value, shape->slotCount);
+    PUBLISH(instance->slots, slots);
+    instance->slotCapacity = shape->slotCount;
+  }
+  for (int i = 0; i < shape->slotCount; i++) {
+    instance->slots[i] = readImageValue(in, objects);
+    writeBarrier(&instance->obj, instance->slots[i]);
+  }
+  PUBLISH(instance->shape, shape);
+  writeBarrier(&instance->obj, OBJ_VAL(shape));
+}
+
+static void readReferences(Reader* in, ValueArray* objects, Obj* object) {
+  switch (object->type) {
+    case OBJ_BOUND_METHOD: {
+      ObjBoundMethod* bound = (ObjBoundMethod*)object;
+      PUBLISH(bound->receiver, readImageValue(in, objects));
+      PUBLISH(
+          bound->method,
+          (ObjClosure*)readImageObject(in, objects, OBJ_CLOSURE));
+      if (bound->method == NULL) in->failed = true;
+      writeBarrier(object, bound->receiver);
+      if (!in->failed) writeBarrier(object, OBJ_VAL(bound->method));
+      break;
+    }
+    case OBJ_CLASS: {
+      ObjClass* klass = (ObjClass*)object;
+      PUBLISH(
+          klass->name,
+          (ObjString*)readImageObject(in, objects, OBJ_STRING));
+      klass->initializer = readImageValue(in, objects);
+      ObjShape* shape = (ObjShape*)readImageObject(in, objects, OBJ_SHAPE);
+      if (klass->name == NULL || shape == NULL) {
+        in->failed = true;
+        break;
+      }
+      PUBLISH(klass->shape, shape);
+      writeBarrier(object, OBJ_VAL(klass->name));
+      writeBarrier(object, klass->initializer);
+      writeBarrier(object, OBJ_VAL(shape));
+      readImageTable(in, objects, &klass->methods, object);
+      break;
+    }
+    case OBJ_CLOSURE: {
+      ObjClosure* closure = (ObjClosure*)object;
+      for (int i = 0; i < closure->upvalueCount && !in->failed; i++) {
+        PUBLISH(
+            closure->upvalues[i],
+            (ObjUpvalue*)readImageObject(in, objects, OBJ_UPVALUE));
+        if (closure->upvalues[i] != NULL)
+          writeBarrier(object, OBJ_VAL(closure->upvalues[i]));
+      }
+      break;
+    }
+    case OBJ_FUNCTION: {
+      ObjFunction* function = (ObjFunction*)object;
+      PUBLISH(
+          function->name,
+          (ObjString*)readImageObject(in, objects, OBJ_STRING));
+      if (function->name != NULL)
+        writeBarrier(object, OBJ_VAL(function->name));
+
+      int count = readCount(in, remaining(in));
+      for (int i = 0; i < count && !in->failed; i++) {
+        Value value = readImageValue(in, objects);
+        addConstant(&function->chunk, value);
+        writeBarrier(object, value);
+      }
+      for (int i = 0; i < function->chunk.switchCount; i++) {
+        Table* cases = &function->chunk.switches[i].cases;
+        readImageTable(in, objects, cases, object);
+      }
+      break;
+    }
+    case OBJ_INSTANCE: readInstance(in, objects, (ObjInstance*)object); break;
+    case OBJ_SHAPE: {
+      ObjShape* shape = (ObjShape*)object;
+      PUBLISH(
+          shape->parent,
+          (ObjShape*)readImageObject(in, objects, OBJ_SHAPE));
+      if (shape->parent != NULL) writeBarrier(object, OBJ_VAL(shape->parent));
+      readImageTable(in, objects, &shape->slots, object);
+      readImageTable(in, objects, &shape->transitions, object);
+      break;
+    }
+    case OBJ_UPVALUE: {
+      ObjUpvalue* upvalue = (ObjUpvalue*)object;
+      PUBLISH(upvalue->closed, readImageValue(in, objects));
+      writeBarrier(object, upvalue->closed);
+      break;
+    }
+    case OBJ_NATIVE:
+    case OBJ_ROPE:
+    case OBJ_STRING: break;
+  }
+}
+
+// Restores the globals saved by saveImage into a VM that has only defined
+// its natives. Strings are interned as they are created, so vm.strings
+// ends up holding the image's strings too.
+bool loadImage(const char* path) {
+  int length;
+  char* buffer = loadFile(path, &length);
+  if (buffer == NULL) return false;
+
+  Writer header;
+  initWriter(&header);
+  writeHeader(&header);
+  Reader in = {buffer, buffer + length, false};
+  bool loaded = readHeader(&in, &header) && readGlobalNames(&in);
+  freeWriter(&header);
+
+  int depth = (int)(vm.stackTop - vm.stack);
+  ObjFunction* holder = newFunction();
+  push(OBJ_VAL(holder));
+  ValueArray* objects = &holder->chunk.constants;
+
+  int count = loaded ? readCount(&in, remaining(&in)) : 0;
+  for (int i = 0; i < count && !in.failed; i++) readCreation(&in, holder);
+  for (int i = 0; i < count && !in.failed; i++)
+    readReferences(&in, objects, AS_OBJ(objects->values[i]));
+
+  Value* globals = vm.globalValues.values;
+  for (int i = 0; i < vm.globalValues.count && loaded; i++)
+    globals[i] = readImageValue(&in, objects);
+
+  loaded = loaded && !in.failed && in.current == in.end;
+  vm.stackTop = vm.stack + depth;
+  free(buffer);
+  return loaded;
+}
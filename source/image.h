@@ -0,0 +1,9 @@
+#ifndef CLOX_IMAGE_H
+#define CLOX_IMAGE_H
+
+#include "common.h"
+
+bool saveImage(const char* path);
+bool loadImage(const char* path);
+
+#endif
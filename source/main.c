@@ -1,11 +1,18 @@
+#include "cache.h"
 #include "chunk.h"
 #include "common.h"
+#include "compiler.h"
 #include "debug.h"
+#include "image.h"
 #include "vm.h"
 
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 static void repl() {
   char line[1024];
@@ -17,58 +24,153 @@ static void repl() {
       break;
     }
 
-    interpret(line, false);
+    interpret(line);
   }
 }
 
-static char* readFile(const char* path) {
+typedef struct {
+  const char* chars;
+  size_t length;
+  bool mapped;
+} Source;
+
+static Source readFile(const char* path) {
   FILE* file = fopen(path, "rb");
   if (file == NULL) {
     fprintf(stderr, "Could not open file \"%s\".\n", path);
     exit(74);
   }
 
-  fseek(file, 0L, SEEK_END);
-  size_t fileSize = ftell(file);
-  rewind(file);
+  // Reads until EOF rather than asking for the size, which a pipe does not
+  // have.
+  size_t capacity = 4096;
+  size_t length = 0;
+  char* buffer = (char*)malloc(capacity);
+  while (buffer != NULL) {
+    length += fread(buffer + length, sizeof(char), capacity - length - 1, file);
+    if (length < capacity - 1) break;
+
+    capacity *= 2;
+    char* grown = (char*)realloc(buffer, capacity);
+    if (grown == NULL) free(buffer);
+    buffer = grown;
+  }
 
-  char* buffer = (char*)malloc(fileSize + 1);
   if (buffer == NULL) {
     fprintf(stderr, "Not enough memory to read \"%s\".\n", path);
     exit(74);
   }
 
-  size_t bytesRead = fread(buffer, sizeof(char), fileSize, file);
-  if (bytesRead < fileSize) {
+  if (ferror(file)) {
     fprintf(stderr, "Could not read file \"%s\".\n", path);
+    free(buffer);
     exit(74);
   }
 
-  buffer[bytesRead] = '\0';
+  buffer[length] = '\0';
 
   fclose(file);
-  return buffer;
+  return (Source){buffer, length, false};
+}
+
+// Regular files are mapped read-only and scanned in place. Anything that
+// cannot be mapped, like a pipe or an empty file, is read into memory.
+static Source mapFile(const char* path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "Could not open file \"%s\".\n", path);
+    exit(74);
+  }
+
+  struct stat info;
+  if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0) {
+    void* chars = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (chars != MAP_FAILED) {
+      close(fd);
+      return (Source){(const char*)chars, (size_t)info.st_size, true};
+    }
+  }
+
+  close(fd);
+  return readFile(path);
+}
+
+static void releaseSource(Source source) {
+  if (source.mapped)
+    munmap((void*)source.chars, source.length);
+  else
+    free((void*)source.chars);
 }
 
-static void runFile(const char* path) {
-  char* source = readFile(path);
-  InterpretResult result = interpret(source, true);
+static void runFile(const char* path, bool cache) {
+  Source source = mapFile(path);
+  int length = (int)source.length;
+  ObjFunction* function = NULL;
+  char* cachePath = NULL;
 
-  if (result == INTERPRET_COMPILE_ERROR) exit(65);
-  if (result == INTERPRET_RUNTIME_ERROR) exit(70);
+  if (cache) {
+    size_t pathLength = strlen(path);
+    cachePath = (char*)malloc(pathLength + 2);
+    if (cachePath == NULL) exit(74);
+    memcpy(cachePath, path, pathLength);
+    memcpy(cachePath + pathLength, "c", 2);
+    function = loadCache(cachePath, source.chars, length);
+  }
+
+  if (function == NULL) {
+    function = compile(source.chars, source.length);
+    if (function != NULL && cache)
+      saveCache(cachePath, function, source.chars, length);
+  }
+
+  free(cachePath);
+  releaseSource(source);
+  if (function == NULL) exit(65);
+  if (interpretFunction(function) == INTERPRET_RUNTIME_ERROR) exit(70);
+}
+
+static void usage() {
+  fprintf(
+      stderr,
+      "Usage: clox [--cache] [--image image] [--save-image image] [path]\n");
+  exit(64);
 }
 
 int main(int argc, const char* argv[]) {
   initVM();
   atexit(freeVM);
 
-  if (argc == 1) {
+  bool cache = false;
+  const char* image = NULL;
+  const char* saveTo = NULL;
+  int arg = 1;
+  for (; arg < argc && strncmp(argv[arg], "--", 2) == 0; arg++) {
+    if (strcmp(argv[arg], "--cache") == 0)
+      cache = true;
+    else if (strcmp(argv[arg], "--image") == 0 && arg + 1 < argc)
+      image = argv[++arg];
+    else if (strcmp(argv[arg], "--save-image") == 0 && arg + 1 < argc)
+      saveTo = argv[++arg];
+    else
+      usage();
+  }
+
+  if (image != NULL && !loadImage(image)) {
+    fprintf(stderr, "Could not load image \"%s\".\n", image);
+    exit(74);
+  }
+
+  if (arg == argc && !cache && saveTo == NULL) {
     repl();
-  } else if (argc == 2) {
-    runFile(argv[1]);
+  } else if (arg + 1 == argc) {
+    runFile(argv[arg], cache);
   } else {
-    fprintf(stderr, "Usage: clox [path]\n");
-    exit(64);
+    usage();
+  }
+
+  if (saveTo != NULL && !saveImage(saveTo)) {
+    fprintf(stderr, "Could not save image \"%s\".\n", saveTo);
+    exit(74);
   }
 
   return 0;
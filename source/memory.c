@@ -4,24 +4,157 @@
 #include "vm.h"
 
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
-#ifdef DEBUG_LOG_GC
+#ifdef CONCURRENT_MARKING
+#include <pthread.h>
+#endif
+
+#if defined(DEBUG_LOG_GC) || defined(DEBUG_LOG_CACHE)
 #include "debug.h"
 
 #include <stdio.h>
 #endif
 
 #define GC_HEAP_GROW_FACTOR 2
+#define GC_STEP_BYTES (64 * 1024)
+#define GC_CLOCK_INTERVAL 64
+
+#define PAGE_SIZE (64 * 1024)
+#define PAGE_WORDS (PAGE_SIZE / CELL_GRANULE / 64)
+#define PAGE_MAX_OBJECT 512
+#define CELL_GRANULE 8
+#define NURSERY_SIZE (1024 * 1024)
+#define FREE_PAGES_MAX (NURSERY_SIZE / PAGE_SIZE)
+
+#define PAGE_OF(object) ((Page*)((uintptr_t)(object) & ~(PAGE_SIZE - 1)))
+#define CELL_INDEX(object) \
+  (((uintptr_t)(object) & (PAGE_SIZE - 1)) / CELL_GRANULE)
+#define CELL_BIT(index) ((uint64_t)1 << ((index) % 64))
+#define CELLS_START \
+  ((sizeof(Page) + CELL_GRANULE - 1) & ~(size_t)(CELL_GRANULE - 1))
+#define LARGE_HEADER_SIZE sizeof(LargeHeader)
+#define LARGE_OF(object) \
+  ((LargeHeader*)((uint8_t*)(object) - LARGE_HEADER_SIZE))
+
+typedef struct Cell {
+  struct Cell* next;
+} Cell;
+
+typedef struct Page {
+  struct Page* next;
+  struct Page* prev;
+  struct Page* nextAvailable;
+  struct Page* prevAvailable;
+  struct Page* nextYoung;
+  Cell* freeCells;
+  uint8_t* top;
+  int sizeClass;
+  int cellSize;
+  int live;
+  int markEpoch;
+  bool isAvailable;
+  bool isYoung;
+  uint64_t youngBits[PAGE_WORDS];
+  uint64_t oldBits[PAGE_WORDS];
+  uint64_t markBits[PAGE_WORDS];
+} Page;
+
+typedef struct {
+  Obj* next;
+  int markEpoch;
+} LargeHeader;
+
+static const int cellSizes[SIZE_CLASSES] = {
+    16,  24,  32,  40,  48,  56,  64,  72,  80,  88,  96,
+    112, 128, 144, 160, 192, 224, 256, 320, 384, 448, 512};
+
+static const uint8_t sizeClasses[PAGE_MAX_OBJECT / CELL_GRANULE + 1] = {
+    0,  0,  0,  1,  2,  3,  4,  5,  6,  7,  8,  9,  10, 11, 11, 12, 12,
+    13, 13, 14, 14, 15, 15, 15, 15, 16, 16, 16, 16, 17, 17, 17, 17, 18,
+    18, 18, 18, 18, 18, 18, 18, 19, 19, 19, 19, 19, 19, 19, 19, 20, 20,
+    20, 20, 20, 20, 20, 20, 21, 21, 21, 21, 21, 21, 21, 21};
+
+static void collectYoung();
+static void gcStep();
+
+#ifdef CONCURRENT_MARKING
+static pthread_mutex_t heapLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t heapChanged = PTHREAD_COND_INITIALIZER;
+static pthread_t marker;
+static bool markerStarted = false;
+static bool markerExit = false;
+static int mutatorWaiting = 0;
+
+static void** deferred = NULL;
+static int deferredCount = 0;
+static int deferredCapacity = 0;
+
+static void lockHeap() {
+  __atomic_add_fetch(&mutatorWaiting, 1, __ATOMIC_SEQ_CST);
+  pthread_mutex_lock(&heapLock);
+  __atomic_sub_fetch(&mutatorWaiting, 1, __ATOMIC_SEQ_CST);
+}
 
-void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
-  vm.bytesAllocated += newSize - oldSize;
-  if (newSize > oldSize) {
-#ifdef DEBUG_STRESS_GC
-    collectGarbage();
+static void unlockHeap() {
+  pthread_cond_signal(&heapChanged);
+  pthread_mutex_unlock(&heapLock);
+}
+
+static void deferFree(void* pointer) {
+  if (deferredCapacity < deferredCount + 1) {
+    deferredCapacity = GROW_CAPACITY(deferredCapacity);
+    deferred = (void**)realloc(deferred, sizeof(void*) * deferredCapacity);
+
+    if (deferred == NULL) exit(1);
+  }
+
+  deferred[deferredCount++] = pointer;
+}
+
+static void freeDeferred() {
+  for (int i = 0; i < deferredCount; i++) free(deferred[i]);
+  deferredCount = 0;
+}
+
+static void* reallocateDeferred(
+    void* pointer, size_t oldSize, size_t newSize) {
+  void* result = NULL;
+  if (newSize > 0) {
+    result = malloc(newSize);
+    if (result == NULL) exit(1);
+    memcpy(result, pointer, oldSize < newSize ? oldSize : newSize);
+  }
+
+  deferFree(pointer);
+  return result;
+}
 #else
-    if (vm.bytesAllocated > vm.nextGC) collectGarbage();
+static inline void lockHeap() {}
+static inline void unlockHeap() {}
 #endif
+
+static void collectIfNeeded() {
+#ifdef DEBUG_STRESS_GC
+  gcStep();
+#else
+  if (vm.gcPhase == GC_IDLE) {
+    if (vm.bytesAllocated - vm.youngBytes > vm.nextGC) gcStep();
+  } else if (vm.bytesAllocated > vm.nextStep) {
+    gcStep();
   }
+#endif
+}
+
+void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
+  vm.bytesAllocated += newSize - oldSize;
+  if (newSize > oldSize) collectIfNeeded();
+
+#ifdef CONCURRENT_MARKING
+  if (vm.gcPhase == GC_MARK && pointer != NULL)
+    return reallocateDeferred(pointer, oldSize, newSize);
+#endif
 
   if (newSize == 0) {
     free(pointer);
@@ -33,18 +166,170 @@ void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
   return result;
 }
 
-void markObject(Obj* object) {
-  if (object == NULL) return;
-  if (object->isMarked) return;
+static void makeAvailable(Page* page) {
+  if (page->isAvailable) return;
+  page->isAvailable = true;
 
-#ifdef DEBUG_LOG_GC
-  printf("%p mark ", (void*)object);
-  printValue(OBJ_VAL(object));
-  printf("\n");
+  Page** head = &vm.availablePages[page->sizeClass];
+  page->prevAvailable = NULL;
+  page->nextAvailable = *head;
+  if (*head != NULL) (*head)->prevAvailable = page;
+  *head = page;
+}
+
+static void makeUnavailable(Page* page) {
+  if (!page->isAvailable) return;
+  page->isAvailable = false;
+
+  if (page->prevAvailable != NULL) {
+    page->prevAvailable->nextAvailable = page->nextAvailable;
+  } else {
+    vm.availablePages[page->sizeClass] = page->nextAvailable;
+  }
+  if (page->nextAvailable != NULL)
+    page->nextAvailable->prevAvailable = page->prevAvailable;
+}
+
+static Page* newPage(int sizeClass) {
+  Page* page = vm.freePages;
+  if (page != NULL) {
+    vm.freePages = page->next;
+    vm.freePageCount--;
+  } else {
+    page = (Page*)aligned_alloc(PAGE_SIZE, PAGE_SIZE);
+    if (page == NULL) exit(1);
+  }
+
+  page->freeCells = NULL;
+  page->top = (uint8_t*)page + CELLS_START;
+  page->sizeClass = sizeClass;
+  page->cellSize = cellSizes[sizeClass];
+  page->live = 0;
+  page->markEpoch = 0;
+  page->isAvailable = false;
+  page->isYoung = false;
+  memset(page->youngBits, 0, sizeof(page->youngBits));
+  memset(page->oldBits, 0, sizeof(page->oldBits));
+
+  page->prev = NULL;
+  page->next = vm.pages;
+  if (vm.pages != NULL) vm.pages->prev = page;
+  vm.pages = page;
+
+  makeAvailable(page);
+  return page;
+}
+
+static void releasePage(Page* page) {
+  makeUnavailable(page);
+  if (vm.sweepPage == page) vm.sweepPage = page->next;
+
+  if (page->prev != NULL) {
+    page->prev->next = page->next;
+  } else {
+    vm.pages = page->next;
+  }
+  if (page->next != NULL) page->next->prev = page->prev;
+
+  if (vm.freePageCount == FREE_PAGES_MAX) {
+    free(page);
+    return;
+  }
+
+  page->next = vm.freePages;
+  vm.freePages = page;
+  vm.freePageCount++;
+}
+
+static bool pageFull(Page* page) {
+  return page->freeCells == NULL &&
+         (uint8_t*)page + PAGE_SIZE - page->top < page->cellSize;
+}
+
+static Obj* allocateCell(int sizeClass) {
+  Page* page = vm.availablePages[sizeClass];
+  if (page == NULL) page = newPage(sizeClass);
+
+  Cell* cell = page->freeCells;
+  if (cell != NULL) {
+    page->freeCells = cell->next;
+  } else {
+    cell = (Cell*)page->top;
+    page->top += page->cellSize;
+  }
+  if (pageFull(page)) makeUnavailable(page);
+
+  size_t index = CELL_INDEX(cell);
+  page->youngBits[index / 64] |= CELL_BIT(index);
+  page->live++;
+
+  if (!page->isYoung) {
+    page->isYoung = true;
+    page->nextYoung = vm.youngPages;
+    vm.youngPages = page;
+  }
+
+  return (Obj*)cell;
+}
+
+static void freeCell(Obj* object) {
+  Page* page = PAGE_OF(object);
+  Cell* cell = (Cell*)object;
+  cell->next = page->freeCells;
+  page->freeCells = cell;
+  page->live--;
+  vm.bytesAllocated -= page->cellSize;
+}
+
+static Obj* cellAt(Page* page, int word, int bit) {
+  return (Obj*)((uint8_t*)page + (size_t)(word * 64 + bit) * CELL_GRANULE);
+}
+
+Obj* allocateYoung(size_t size) {
+#ifdef DEBUG_STRESS_GC
+  bool nurseryFull = true;
+#else
+  bool nurseryFull = vm.youngBytes + size > NURSERY_SIZE;
 #endif
 
-  object->isMarked = true;
+  if (nurseryFull) {
+    lockHeap();
+    collectYoung();
+    unlockHeap();
+  }
+
+  if (size > PAGE_MAX_OBJECT) {
+    LargeHeader* header =
+        (LargeHeader*)reallocate(NULL, 0, LARGE_HEADER_SIZE + size);
+    header->markEpoch = 0;
+
+    Obj* object = (Obj*)((uint8_t*)header + LARGE_HEADER_SIZE);
+    vm.youngBytes += size;
+    object->inPage = false;
+    header->next = vm.youngObjects;
+    vm.youngObjects = object;
+    return object;
+  }
+
+  collectIfNeeded();
+  int sizeClass = sizeClasses[(size + CELL_GRANULE - 1) / CELL_GRANULE];
+  vm.bytesAllocated += cellSizes[sizeClass];
+  vm.youngBytes += cellSizes[sizeClass];
+
+  Obj* object = allocateCell(sizeClass);
+  object->inPage = true;
+  return object;
+}
+
+static void releaseObject(Obj* object, size_t size) {
+  if (object->inPage) {
+    freeCell(object);
+  } else {
+    reallocate(LARGE_OF(object), LARGE_HEADER_SIZE + size, 0);
+  }
+}
 
+static void pushGray(Obj* object) {
   if (vm.grayCapacity < vm.grayCount + 1) {
     vm.grayCapacity = GROW_CAPACITY(vm.grayCapacity);
     vm.grayStack =
@@ -56,12 +341,98 @@ void markObject(Obj* object) {
   vm.grayStack[vm.grayCount++] = object;
 }
 
+void rememberObject(Obj* object) {
+  if (!object->isOld || object->isRemembered) return;
+  object->isRemembered = true;
+
+  if (vm.rememberedCapacity < vm.rememberedCount + 1) {
+    vm.rememberedCapacity = GROW_CAPACITY(vm.rememberedCapacity);
+    vm.remembered =
+        (Obj**)realloc(vm.remembered, sizeof(Obj*) * vm.rememberedCapacity);
+
+    if (vm.remembered == NULL) exit(1);
+  }
+
+  vm.remembered[vm.rememberedCount++] = object;
+}
+
+static uint64_t markWord(Page* page, int word) {
+  return page->markEpoch == vm.markEpoch ? page->markBits[word] : 0;
+}
+
+bool isMarked(Obj* object) {
+  if (!object->inPage) return LARGE_OF(object)->markEpoch == vm.markEpoch;
+
+  size_t index = CELL_INDEX(object);
+  return (markWord(PAGE_OF(object), index / 64) & CELL_BIT(index)) != 0;
+}
+
+void markObject(Obj* object) {
+  if (object == NULL) return;
+  if (object->isOld == vm.collectingYoung) return;
+
+  if (object->inPage) {
+    Page* page = PAGE_OF(object);
+    if (page->markEpoch != vm.markEpoch) {
+      memset(page->markBits, 0, sizeof(page->markBits));
+      page->markEpoch = vm.markEpoch;
+    }
+
+    size_t index = CELL_INDEX(object);
+    uint64_t* word = &page->markBits[index / 64];
+    if (*word & CELL_BIT(index)) return;
+    *word |= CELL_BIT(index);
+  } else {
+    LargeHeader* header = LARGE_OF(object);
+    if (header->markEpoch == vm.markEpoch) return;
+    header->markEpoch = vm.markEpoch;
+  }
+
+#ifdef DEBUG_LOG_GC
+  printf("%p mark ", (void*)object);
+  printValue(OBJ_VAL(object));
+  printf("\n");
+#endif
+
+  pushGray(object);
+}
+
 void markValue(Value value) {
   if (IS_OBJ(value)) markObject(AS_OBJ(value));
 }
 
 static void markArray(ValueArray* array) {
-  for (int i = 0; i < array->count; i++) markValue(array->values[i]);
+  int count = CONSUME(array->count);
+  Value* values = CONSUME(array->values);
+  for (int i = 0; i < count; i++) markValue(CONSUME(values[i]));
+}
+
+static void markCaches(Chunk* chunk) {
+  int callsiteCount = CONSUME(chunk->callsiteCount);
+  Callsite* callsites = CONSUME(chunk->callsites);
+  for (int i = 0; i < callsiteCount; i++) {
+    Callsite* callsite = &callsites[i];
+    int count = CONSUME(callsite->count);
+    for (int j = 0; j < count; j++) {
+      markObject(CONSUME(callsite->entries[j].key));
+      markObject((Obj*)CONSUME(callsite->entries[j].method));
+    }
+  }
+
+  int cacheCount = CONSUME(chunk->cacheCount);
+  PropertyCache* caches = CONSUME(chunk->caches);
+  for (int i = 0; i < cacheCount; i++) {
+    PropertyCache* cache = &caches[i];
+    markObject((Obj*)CONSUME(cache->shape));
+    markObject((Obj*)CONSUME(cache->transition));
+    markObject((Obj*)CONSUME(cache->method));
+  }
+}
+
+static void markSwitches(Chunk* chunk) {
+  int switchCount = CONSUME(chunk->switchCount);
+  SwitchTable* switches = CONSUME(chunk->switches);
+  for (int i = 0; i < switchCount; i++) markTable(&switches[i].cases);
 }
 
 static void blackenObject(Obj* object) {
@@ -74,37 +445,63 @@ static void blackenObject(Obj* object) {
   switch (object->type) {
     case OBJ_BOUND_METHOD: {
       ObjBoundMethod* bound = (ObjBoundMethod*)object;
-      markValue(bound->receiver);
-      markObject((Obj*)bound->method);
+      markValue(CONSUME(bound->receiver));
+      markObject((Obj*)CONSUME(bound->method));
       break;
     }
     case OBJ_CLASS: {
       ObjClass* klass = (ObjClass*)object;
-      markObject((Obj*)klass->name);
+      markObject((Obj*)CONSUME(klass->name));
       markTable(&klass->methods);
+      markObject((Obj*)CONSUME(klass->shape));
       break;
     }
     case OBJ_CLOSURE: {
       ObjClosure* closure = (ObjClosure*)object;
       markObject((Obj*)closure->function);
       for (int i = 0; i < closure->upvalueCount; i++) {
-        markObject((Obj*)closure->upvalues[i]);
+        markObject((Obj*)CONSUME(closure->upvalues[i]));
       }
       break;
     }
     case OBJ_FUNCTION: {
       ObjFunction* function = (ObjFunction*)object;
-      markObject((Obj*)function->name);
+      markObject((Obj*)CONSUME(function->name));
       markArray(&function->chunk.constants);
+      markCaches(&function->chunk);
+      markSwitches(&function->chunk);
       break;
     }
     case OBJ_INSTANCE: {
       ObjInstance* instance = (ObjInstance*)object;
+      ObjShape* shape = CONSUME(instance->shape);
       markObject((Obj*)instance->klass);
-      markTable(&instance->fields);
+      if (shape != NULL) {
+        Value* slots = CONSUME(instance->slots);
+        markObject((Obj*)shape);
+        for (int i = 0; i < shape->slotCount; i++)
+          markValue(CONSUME(slots[i]));
+      } else {
+        markTable(CONSUME(instance->fields));
+      }
+      break;
+    }
+    case OBJ_SHAPE: {
+      ObjShape* shape = (ObjShape*)object;
+      markObject((Obj*)CONSUME(shape->parent));
+      markTable(&shape->slots);
+      markTable(&shape->transitions);
       break;
     }
-    case OBJ_UPVALUE: markValue(((ObjUpvalue*)object)->closed); break;
+    case OBJ_ROPE: {
+      ObjRope* rope = (ObjRope*)object;
+      markValue(CONSUME(rope->left));
+      markValue(CONSUME(rope->right));
+      break;
+    }
+    case OBJ_UPVALUE:
+      markValue(CONSUME(((ObjUpvalue*)object)->closed));
+      break;
     case OBJ_NATIVE:
     case OBJ_STRING: break;
   }
@@ -116,38 +513,58 @@ static void freeObject(Obj* object) {
 #endif
 
   switch (object->type) {
-    case OBJ_BOUND_METHOD: FREE(ObjBoundMethod, object); break;
+    case OBJ_BOUND_METHOD: releaseObject(object, sizeof(ObjBoundMethod)); break;
     case OBJ_CLASS: {
       ObjClass* klass = (ObjClass*)object;
       freeTable(&klass->methods);
-      FREE(ObjClass, object);
+      releaseObject(object, sizeof(ObjClass));
       break;
     }
     case OBJ_CLOSURE: {
       ObjClosure* closure = (ObjClosure*)object;
       FREE_ARRAY(ObjUpvalue*, closure->upvalues, closure->upvalueCount);
-      FREE(ObjClosure, object);
+      releaseObject(object, sizeof(ObjClosure));
       break;
     }
     case OBJ_FUNCTION: {
       ObjFunction* function = (ObjFunction*)object;
+#ifdef DEBUG_LOG_CACHE
+      printCaches(
+          &function->chunk,
+          function->name != NULL ? function->name->chars : "<script>");
+#endif
       freeChunk(&function->chunk);
-      FREE(ObjFunction, object);
+      releaseObject(object, sizeof(ObjFunction));
       break;
     }
     case OBJ_INSTANCE: {
       ObjInstance* instance = (ObjInstance*)object;
-      freeTable(&instance->fields);
-      FREE(ObjInstance, object);
+      if (instance->slots != instance->inlineSlots)
+        FREE_ARRAY(Value, instance->slots, instance->slotCapacity);
+      if (instance->fields != NULL) {
+        freeTable(instance->fields);
+        FREE(Table, instance->fields);
+      }
+      releaseObject(
+          object,
+          sizeof(ObjInstance) + sizeof(Value) * instance->inlineCapacity);
+      break;
+    }
+    case OBJ_NATIVE: releaseObject(object, sizeof(ObjNative)); break;
+    case OBJ_ROPE: releaseObject(object, sizeof(ObjRope)); break;
+    case OBJ_SHAPE: {
+      ObjShape* shape = (ObjShape*)object;
+      freeTable(&shape->slots);
+      freeTable(&shape->transitions);
+      releaseObject(object, sizeof(ObjShape));
       break;
     }
-    case OBJ_NATIVE: FREE(ObjNative, object); break;
     case OBJ_STRING: {
       ObjString* string = (ObjString*)object;
-      reallocate(string, sizeof(ObjString) + string->length + 1, 0);
+      releaseObject(object, sizeof(ObjString) + string->length + 1);
       break;
     }
-    case OBJ_UPVALUE: FREE(ObjUpvalue, object); break;
+    case OBJ_UPVALUE: releaseObject(object, sizeof(ObjUpvalue)); break;
   }
 }
 
@@ -171,63 +588,382 @@ static void markRoots() {
   markObject((Obj*)vm.initString);
 }
 
-static void traceReferences() {
-  while (vm.grayCount > 0) {
+static void traceReferences(int base) {
+  while (vm.grayCount > base) {
     Obj* object = vm.grayStack[--vm.grayCount];
     blackenObject(object);
   }
 }
 
-static void sweep() {
-  Obj* previous = NULL;
-  Obj* object = vm.objects;
-  while (object != NULL) {
-    if (object->isMarked) {
-      object->isMarked = false;
-      previous = object;
-      object = object->next;
-    } else {
-      Obj* unreached = object;
-      object = object->next;
-      if (previous != NULL) {
-        previous->next = object;
+static void markRemembered() {
+  for (int i = 0; i < vm.rememberedCount; i++) {
+    blackenObject(vm.remembered[i]);
+  }
+}
+
+static void forgetRemembered() {
+  for (int i = 0; i < vm.rememberedCount; i++) {
+    Obj* object = vm.remembered[i];
+    object->isRemembered = false;
+    if (vm.gcPhase == GC_MARK && isMarked(object)) pushGray(object);
+  }
+  vm.rememberedCount = 0;
+}
+
+static double now() {
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+static void recordPause(double start) {
+  double pause = now() - start;
+  if (pause > vm.maxPause) vm.maxPause = pause;
+}
+
+static bool outOfTime(int work, double deadline) {
+#ifdef DEBUG_STRESS_GC
+  (void)work;
+  (void)deadline;
+  return true;
+#else
+  return work % GC_CLOCK_INTERVAL == 0 && now() > deadline;
+#endif
+}
+
+static void sweepYoungPage(Page* page) {
+  for (int i = 0; i < PAGE_WORDS; i++) {
+    uint64_t young = page->youngBits[i];
+    if (young == 0) continue;
+
+    uint64_t survivors = young & markWord(page, i);
+    page->youngBits[i] = 0;
+    page->oldBits[i] |= survivors;
+
+    while (young != 0) {
+      int bit = __builtin_ctzll(young);
+      young &= young - 1;
+
+      Obj* object = cellAt(page, i, bit);
+      if (survivors & CELL_BIT(bit)) {
+        object->isOld = true;
+        if (vm.gcPhase == GC_MARK) pushGray(object);
       } else {
-        vm.objects = object;
+        if (object->type == OBJ_STRING)
+          tableRemoveString(&vm.strings, (ObjString*)object);
+        freeObject(object);
       }
+    }
+  }
+}
 
-      freeObject(unreached);
+static void sweepYoung() {
+  Page* page = vm.youngPages;
+  while (page != NULL) {
+    Page* next = page->nextYoung;
+    page->isYoung = false;
+    sweepYoungPage(page);
+    if (page->live == 0) {
+      releasePage(page);
+    } else if (page->freeCells != NULL) {
+      makeAvailable(page);
+    }
+    page = next;
+  }
+  vm.youngPages = NULL;
+
+  Obj* object = vm.youngObjects;
+  while (object != NULL) {
+    Obj* next = LARGE_OF(object)->next;
+    if (isMarked(object)) {
+      object->isOld = true;
+      LARGE_OF(object)->next = vm.objects;
+      vm.objects = object;
+      if (vm.gcPhase == GC_MARK) pushGray(object);
+    } else {
+      if (object->type == OBJ_STRING)
+        tableRemoveString(&vm.strings, (ObjString*)object);
+      freeObject(object);
     }
+    object = next;
   }
+
+  vm.youngObjects = NULL;
+  vm.youngBytes = 0;
 }
 
-void collectGarbage() {
+static void collectYoung() {
 #ifdef DEBUG_LOG_GC
-  printf("-- gc begin\n");
+  printf("-- minor gc begin\n");
   size_t before = vm.bytesAllocated;
 #endif
 
+  double start = now();
+  int base = vm.grayCount;
+
+  vm.collectingYoung = true;
   markRoots();
-  traceReferences();
-  tableRemoveWhite(&vm.strings);
-  sweep();
+  markRemembered();
+  traceReferences(base);
+  vm.collectingYoung = false;
+  forgetRemembered();
+  sweepYoung();
 
-  vm.nextGC = vm.bytesAllocated * GC_HEAP_GROW_FACTOR;
+  recordPause(start);
 
 #ifdef DEBUG_LOG_GC
-  printf("-- gc end\n");
+  printf("-- minor gc end\n");
   printf(
-      "   collected %zu bytes (from %zu to %zu) next at %zu\n",
-      before - vm.bytesAllocated, before, vm.bytesAllocated, vm.nextGC);
+      "   collected %zu bytes (from %zu to %zu)\n", before - vm.bytesAllocated,
+      before, vm.bytesAllocated);
 #endif
 }
 
-void freeObjects() {
-  Obj* object = vm.objects;
+#ifdef CONCURRENT_MARKING
+static void* markConcurrently(void* arg) {
+  (void)arg;
+
+  pthread_mutex_lock(&heapLock);
+  while (!markerExit) {
+    if (vm.gcPhase != GC_MARK || vm.grayCount == 0 ||
+        __atomic_load_n(&mutatorWaiting, __ATOMIC_SEQ_CST) > 0) {
+      pthread_cond_wait(&heapChanged, &heapLock);
+      continue;
+    }
+
+    blackenObject(vm.grayStack[--vm.grayCount]);
+  }
+  pthread_mutex_unlock(&heapLock);
+
+  return NULL;
+}
+
+static void startMarker() {
+  if (markerStarted) return;
+  if (pthread_create(&marker, NULL, markConcurrently, NULL) != 0) exit(1);
+  markerStarted = true;
+}
+
+static void stopMarker() {
+  if (!markerStarted) return;
+
+  lockHeap();
+  markerExit = true;
+  unlockHeap();
+
+  pthread_join(marker, NULL);
+  markerStarted = false;
+  markerExit = false;
+}
+#endif
+
+static void startMarking() {
+#ifdef DEBUG_LOG_GC
+  printf("-- gc begin\n");
+#endif
+
+#ifdef CONCURRENT_MARKING
+  startMarker();
+#endif
+
+  vm.gcPhase = GC_MARK;
+  vm.markEpoch++;
+  markRoots();
+}
+
+#ifndef CONCURRENT_MARKING
+static bool markStep(double deadline) {
+  int work = 0;
+  while (vm.grayCount > 0) {
+    blackenObject(vm.grayStack[--vm.grayCount]);
+    if (outOfTime(++work, deadline)) break;
+  }
+  return vm.grayCount == 0;
+}
+#endif
+
+static void finishMarking() {
+  collectYoung();
+  markRoots();
+  traceReferences(0);
+
+  vm.gcPhase = GC_SWEEP_STRINGS;
+  vm.sweepList = vm.objects;
+  vm.objects = NULL;
+  vm.stringCursor = 0;
+  vm.stringCapacity = vm.strings.capacity;
+
+#ifdef CONCURRENT_MARKING
+  freeDeferred();
+#endif
+}
+
+static bool sweepStringsStep(double deadline) {
+  if (vm.strings.capacity != vm.stringCapacity) {
+    vm.stringCursor = 0;
+    vm.stringCapacity = vm.strings.capacity;
+  }
+
+  int work = 0;
+  while (vm.stringCursor < vm.stringCapacity) {
+    int end = vm.stringCursor + GC_CLOCK_INTERVAL;
+    if (end > vm.stringCapacity) end = vm.stringCapacity;
+    tableRemoveWhite(&vm.strings, vm.stringCursor, end);
+    vm.stringCursor = end;
+
+    work += GC_CLOCK_INTERVAL;
+    if (outOfTime(work, deadline)) break;
+  }
+  return vm.stringCursor == vm.stringCapacity;
+}
+
+static void startSweeping() {
+  vm.gcPhase = GC_SWEEP;
+  vm.sweepPage = vm.pages;
+}
+
+static void sweepPage(Page* page) {
+  for (int i = 0; i < PAGE_WORDS; i++) {
+    uint64_t dead = page->oldBits[i] & ~markWord(page, i);
+    page->oldBits[i] &= ~dead;
+
+    while (dead != 0) {
+      int bit = __builtin_ctzll(dead);
+      dead &= dead - 1;
+      freeObject(cellAt(page, i, bit));
+    }
+  }
+}
+
+static bool sweepStep(double deadline) {
+  int work = 0;
+  while (vm.sweepPage != NULL) {
+    Page* page = vm.sweepPage;
+    vm.sweepPage = page->next;
+    sweepPage(page);
+    if (page->live == 0) {
+      releasePage(page);
+    } else if (page->freeCells != NULL) {
+      makeAvailable(page);
+    }
+
+    work += GC_CLOCK_INTERVAL;
+    if (outOfTime(work, deadline)) return false;
+  }
+
+  while (vm.sweepList != NULL) {
+    Obj* object = vm.sweepList;
+    vm.sweepList = LARGE_OF(object)->next;
+
+    if (isMarked(object)) {
+      LARGE_OF(object)->next = vm.objects;
+      vm.objects = object;
+    } else {
+      freeObject(object);
+    }
+
+    if (outOfTime(++work, deadline)) break;
+  }
+  return vm.sweepList == NULL;
+}
+
+static void finishSweeping() {
+  vm.gcPhase = GC_IDLE;
+  vm.nextGC = (vm.bytesAllocated - vm.youngBytes) * GC_HEAP_GROW_FACTOR;
+
+#ifdef DEBUG_LOG_GC
+  printf("-- gc end\n");
+  printf("   %zu bytes in use, next at %zu\n", vm.bytesAllocated, vm.nextGC);
+#endif
+}
+
+static void gcStep() {
+  double start = now();
+  double deadline = start + GC_STEP_BUDGET / 1e6;
+  lockHeap();
+
+  switch (vm.gcPhase) {
+    case GC_IDLE: startMarking(); break;
+    case GC_MARK:
+#ifdef CONCURRENT_MARKING
+      if (vm.grayCount == 0) finishMarking();
+#else
+      if (markStep(deadline)) finishMarking();
+#endif
+      break;
+    case GC_SWEEP_STRINGS:
+      if (sweepStringsStep(deadline)) startSweeping();
+      break;
+    case GC_SWEEP:
+      if (sweepStep(deadline)) finishSweeping();
+      break;
+  }
+
+  vm.nextStep = vm.bytesAllocated + GC_STEP_BYTES;
+  unlockHeap();
+  recordPause(start);
+}
+
+void collectGarbage() {
+  lockHeap();
+  if (vm.gcPhase == GC_IDLE) startMarking();
+  if (vm.gcPhase == GC_MARK) finishMarking();
+  unlockHeap();
+
+  while (vm.gcPhase != GC_IDLE) gcStep();
+}
+
+static void freeList(Obj* object) {
   while (object != NULL) {
-    Obj* next = object->next;
+    Obj* next = LARGE_OF(object)->next;
     freeObject(object);
     object = next;
   }
+}
+
+void freeObjects() {
+#ifdef DEBUG_LOG_GC
+  printf("-- max gc pause %.3f ms\n", vm.maxPause * 1000);
+#endif
+
+#ifdef CONCURRENT_MARKING
+  stopMarker();
+#endif
+
+  freeList(vm.objects);
+  freeList(vm.sweepList);
+  freeList(vm.youngObjects);
+
+  for (Page* page = vm.pages; page != NULL; page = page->next) {
+    for (int i = 0; i < PAGE_WORDS; i++) {
+      uint64_t live = page->youngBits[i] | page->oldBits[i];
+      while (live != 0) {
+        int bit = __builtin_ctzll(live);
+        live &= live - 1;
+        freeObject(cellAt(page, i, bit));
+      }
+    }
+  }
+
+  while (vm.pages != NULL) {
+    Page* next = vm.pages->next;
+    free(vm.pages);
+    vm.pages = next;
+  }
+
+  while (vm.freePages != NULL) {
+    Page* next = vm.freePages->next;
+    free(vm.freePages);
+    vm.freePages = next;
+  }
 
   free(vm.grayStack);
+  free(vm.remembered);
+
+#ifdef CONCURRENT_MARKING
+  freeDeferred();
+  free(deferred);
+  deferred = NULL;
+  deferredCapacity = 0;
+#endif
 }
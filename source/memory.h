@@ -2,6 +2,7 @@
 #define CLOX_MEMORY_H
 
 #include "object.h"
+#include "vm.h"
 
 #define ALLOCATE(type, count) \
   (type*)reallocate(NULL, 0, sizeof(type) * (count))
@@ -17,10 +18,33 @@
 #define FREE_ARRAY(type, pointer, oldCount) \
   reallocate(pointer, sizeof(type) * (oldCount), 0)
 
+// Fields the marker reads while the mutator runs are stored with PUBLISH
+// and loaded by the marker with CONSUME. Anything written before a
+// PUBLISH is visible to a marker that CONSUMEs the published value.
+#ifdef CONCURRENT_MARKING
+#ifndef NAN_BOXING
+#error "CONCURRENT_MARKING needs NAN_BOXING to store values atomically."
+#endif
+#define PUBLISH(field, value) \
+  __atomic_store_n(&(field), (value), __ATOMIC_RELEASE)
+#define CONSUME(field) __atomic_load_n(&(field), __ATOMIC_ACQUIRE)
+#else
+#define PUBLISH(field, value) ((field) = (value))
+#define CONSUME(field) (field)
+#endif
+
 void* reallocate(void* pointer, size_t oldSize, size_t newSize);
+Obj* allocateYoung(size_t size);
+void rememberObject(Obj* object);
+bool isMarked(Obj* object);
 void markObject(Obj* object);
 void markValue(Value value);
 void collectGarbage();
 void freeObjects();
 
+static inline void writeBarrier(Obj* object, Value value) {
+  if (!object->isOld || !IS_OBJ(value)) return;
+  if (!AS_OBJ(value)->isOld || vm.gcPhase == GC_MARK) rememberObject(object);
+}
+
 #endif
@@ -3,6 +3,7 @@
 #include "memory.h"
 #include "object.h"
 #include "value.h"
+#include "vm.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -53,11 +54,10 @@ bool clockNative(int argc, Value* argv) {
 bool strNative(int argc, Value* argv) {
   ASSERT_ARITY(1);
   Value value = *argv;
-  if (IS_STRING(value)) NATIVE_RETURN(value);
-  char* str = valToStr(value);
-  if (str == NULL)
-    NATIVE_ERROR("Could not convert argument 1 of str to a string.");
-  NATIVE_RETURN(OBJ_VAL(takeString(str, strlen(str))));
+  if (isString(value)) NATIVE_RETURN(value);
+  vm.writer.length = 0;
+  writeValue(&vm.writer, value);
+  NATIVE_RETURN(stringValue(vm.writer.chars, vm.writer.length));
 }
 
 bool hashNative(int argc, Value* argv) {
@@ -65,27 +65,33 @@ bool hashNative(int argc, Value* argv) {
   NATIVE_RETURN(NUMBER_VAL(hashValue(*argv)));
 }
 
+static bool propertyName(Value* argv) {
+  if (!isString(argv[1])) return false;
+  argv[1] = OBJ_VAL(heapString(argv[1]));
+  return true;
+}
+
 bool hasFieldNative(int argc, Value* argv) {
   ASSERT_ARITY(2);
   if (!IS_INSTANCE(argv[0]))
     NATIVE_ERROR("Argument 1 of hasField must be an instance.");
-  if (!IS_STRING(argv[1]))
+  if (!propertyName(argv))
     NATIVE_ERROR("Argument 2 of hasField must be a string.");
 
   NATIVE_RETURN(
-      BOOL_VAL(tableGet(&AS_INSTANCE(argv[0])->fields, argv[1], NULL)));
+      BOOL_VAL(instanceGet(AS_INSTANCE(argv[0]), argv[1], NULL)));
 }
 
 bool getFieldNative(int argc, Value* argv) {
   ASSERT_ARITY(2);
   if (!IS_INSTANCE(argv[0]))
     NATIVE_ERROR("Argument 1 of getField must be an instance.");
-  if (!IS_STRING(argv[1]))
+  if (!propertyName(argv))
     NATIVE_ERROR("Argument 2 of getField must be a string.");
 
   Value value;
 
-  if (!tableGet(&AS_INSTANCE(argv[0])->fields, argv[1], &value)) {
+  if (!instanceGet(AS_INSTANCE(argv[0]), argv[1], &value)) {
     char* strInstance = valToStr(argv[0]);
 
     if (strInstance == NULL)
@@ -111,19 +117,19 @@ bool setFieldNative(int argc, Value* argv) {
   ASSERT_ARITY(3);
   if (!IS_INSTANCE(argv[0]))
     NATIVE_ERROR("Argument 1 of setField must be an instance.");
-  if (!IS_STRING(argv[1]))
+  if (!propertyName(argv))
     NATIVE_ERROR("Argument 2 of setField must be a string.");
 
   NATIVE_RETURN(
-      BOOL_VAL(tableSet(&AS_INSTANCE(argv[0])->fields, argv[1], argv[2])));
+      BOOL_VAL(instanceSet(AS_INSTANCE(argv[0]), argv[1], argv[2])));
 }
 
 bool deleteFieldNative(int argc, Value* argv) {
   ASSERT_ARITY(2);
   if (!IS_INSTANCE(argv[0]))
     NATIVE_ERROR("Argument 1 of deleteField must be an instance.");
-  if (!IS_STRING(argv[1]))
+  if (!propertyName(argv))
     NATIVE_ERROR("Argument 2 of deleteField must be a string.");
 
-  NATIVE_RETURN(BOOL_VAL(tableDelete(&AS_INSTANCE(argv[0])->fields, argv[1])));
+  NATIVE_RETURN(BOOL_VAL(instanceDelete(AS_INSTANCE(argv[0]), argv[1])));
 }
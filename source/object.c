@@ -1,23 +1,27 @@
 #include "object.h"
 
+#include "hash.h"
 #include "memory.h"
 #include "table.h"
 #include "value.h"
 #include "vm.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #define ALLOCATE_OBJ(type, objectType) \
   (type*)allocateObject(sizeof(type), objectType)
 
+#define SHAPE_MAX_SLOTS 64
+#define SHAPE_MAX_TRANSITIONS 32
+#define ROPE_STACK_INITIAL 32
+
 static Obj* allocateObject(size_t size, ObjType type) {
-  Obj* object = (Obj*)reallocate(NULL, 0, size);
+  Obj* object = allocateYoung(size);
   object->type = type;
-  object->isMarked = false;
-
-  object->next = vm.objects;
-  vm.objects = object;
+  object->isOld = false;
+  object->isRemembered = false;
 
 #ifdef DEBUG_LOG_GC
   printf("%p allocate %zu for %d\n", (void*)object, size, type);
@@ -38,6 +42,14 @@ ObjClass* newClass(ObjString* name) {
   klass->name = name;
   klass->initializer = NIL_VAL;
   initTable(&klass->methods);
+  klass->shape = NULL;
+  klass->instanceSlots = 0;
+
+  push(OBJ_VAL(klass));
+  PUBLISH(klass->shape, newShape(NULL));
+  writeBarrier(&klass->obj, OBJ_VAL(klass->shape));
+  pop();
+
   return klass;
 }
 
@@ -62,9 +74,15 @@ ObjFunction* newFunction() {
 }
 
 ObjInstance* newInstance(ObjClass* klass) {
-  ObjInstance* instance = ALLOCATE_OBJ(ObjInstance, OBJ_INSTANCE);
+  int inlineCapacity = klass->instanceSlots;
+  ObjInstance* instance = (ObjInstance*)allocateObject(
+      sizeof(ObjInstance) + sizeof(Value) * inlineCapacity, OBJ_INSTANCE);
   instance->klass = klass;
-  initTable(&instance->fields);
+  instance->shape = klass->shape;
+  instance->slots = instance->inlineSlots;
+  instance->slotCapacity = inlineCapacity;
+  instance->inlineCapacity = inlineCapacity;
+  instance->fields = NULL;
   return instance;
 }
 
@@ -74,6 +92,23 @@ ObjNative* newNative(NativeFn function) {
   return native;
 }
 
+ObjRope* newRope(Value left, Value right, int length) {
+  ObjRope* rope = ALLOCATE_OBJ(ObjRope, OBJ_ROPE);
+  rope->length = length;
+  rope->left = left;
+  rope->right = right;
+  return rope;
+}
+
+ObjShape* newShape(ObjShape* parent) {
+  ObjShape* shape = ALLOCATE_OBJ(ObjShape, OBJ_SHAPE);
+  shape->parent = parent;
+  shape->slotCount = 0;
+  initTable(&shape->slots);
+  initTable(&shape->transitions);
+  return shape;
+}
+
 ObjString* allocateString(int length) {
   ObjString* string =
       (ObjString*)allocateObject(sizeof(ObjString) + length + 1, OBJ_STRING);
@@ -82,15 +117,6 @@ ObjString* allocateString(int length) {
   return string;
 }
 
-uint32_t hashString(const char* key, int length) {
-  uint32_t hash = 2166136261u;
-  for (int i = 0; i < length; i++) {
-    hash ^= (uint8_t)key[i];
-    hash *= 16777619;
-  }
-  return hash;
-}
-
 ObjString* takeString(char* chars, int length) {
   ObjString* string = copyString(chars, length);
 
@@ -117,6 +143,103 @@ ObjString* copyString(const char* chars, int length) {
   return string;
 }
 
+ObjString* internString(ObjString* string) {
+  string->chars[string->length] = '\0';
+  string->hash = hashString(string->chars, string->length);
+
+  ObjString* interned = tableFindString(
+      &vm.strings, string->chars, string->length, string->hash);
+  if (interned != NULL) return interned;
+
+  push(OBJ_VAL(string));
+  tableSet(&vm.strings, OBJ_VAL(string), NIL_VAL);
+  pop();
+
+  return string;
+}
+
+void copyRope(ObjRope* rope, char* chars) {
+  Value initial[ROPE_STACK_INITIAL];
+  int capacity = ROPE_STACK_INITIAL;
+  int count = 0;
+  Value* stack = initial;
+
+  int end = rope->length;
+  stack[count++] = OBJ_VAL(rope);
+  while (count > 0) {
+    Value node = stack[--count];
+    if (IS_ROPE(node) && !IS_NIL(AS_ROPE(node)->right)) {
+      if (capacity < count + 2) {
+        capacity *= 2;
+        if (stack == initial) {
+          stack = (Value*)malloc(sizeof(Value) * capacity);
+          if (stack != NULL) memcpy(stack, initial, sizeof(initial));
+        } else {
+          stack = (Value*)realloc(stack, sizeof(Value) * capacity);
+        }
+        if (stack == NULL) exit(1);
+      }
+      stack[count++] = AS_ROPE(node)->left;
+      stack[count++] = AS_ROPE(node)->right;
+      continue;
+    }
+
+    if (IS_ROPE(node)) node = AS_ROPE(node)->left;
+    end -= stringLength(node);
+    copyChars(node, chars + end);
+  }
+
+  if (stack != initial) free(stack);
+}
+
+ObjString* flattenRope(ObjRope* rope) {
+  if (IS_NIL(rope->right)) return AS_STRING(rope->left);
+
+  push(OBJ_VAL(rope));
+  ObjString* string = allocateString(rope->length);
+  copyRope(rope, string->chars);
+  ObjString* interned = internString(string);
+
+  PUBLISH(rope->left, OBJ_VAL(interned));
+  PUBLISH(rope->right, NIL_VAL);
+  writeBarrier(&rope->obj, OBJ_VAL(interned));
+  pop();
+
+  return interned;
+}
+
+void copyChars(Value value, char* chars) {
+#ifdef NAN_BOXING
+  if (IS_SMALL_STRING(value)) {
+    smallStringChars(value, chars);
+    return;
+  }
+#endif
+  if (IS_ROPE(value)) {
+    copyRope(AS_ROPE(value), chars);
+    return;
+  }
+  memcpy(chars, AS_STRING(value)->chars, AS_STRING(value)->length);
+}
+
+Value stringValue(const char* chars, int length) {
+#ifdef NAN_BOXING
+  if (length <= SMALL_STRING_MAX) return smallString(chars, length);
+#endif
+  return OBJ_VAL(copyString(chars, length));
+}
+
+ObjString* heapString(Value value) {
+#ifdef NAN_BOXING
+  if (IS_SMALL_STRING(value)) {
+    char chars[sizeof(Value)];
+    smallStringChars(value, chars);
+    return copyString(chars, SMALL_STRING_LENGTH(value));
+  }
+#endif
+  return AS_STRING(value);
+}
+
 ObjUpvalue* newUpvalue(Value* slot) {
   ObjUpvalue* upvalue = ALLOCATE_OBJ(ObjUpvalue, OBJ_UPVALUE);
   upvalue->closed = NIL_VAL;
@@ -125,24 +248,152 @@ ObjUpvalue* newUpvalue(Value* slot) {
   return upvalue;
 }
 
-static int fnToStr(char** buff, ObjFunction* function) {
-  if (function->name == NULL) return asprintf(buff, "<script>");
-  return asprintf(buff, "<fn %s>", function->name->chars);
+static void writeString(Writer* writer, ObjString* string) {
+  writeChars(writer, string->chars, string->length);
 }
 
-int objToStr(char** buff, Value value) {
+static void writeFunction(Writer* writer, ObjFunction* function) {
+  if (function->name == NULL) {
+    writeChars(writer, "<script>", 8);
+    return;
+  }
+  writeChars(writer, "<fn ", 4);
+  writeString(writer, function->name);
+  writeChars(writer, ">", 1);
+}
+
+void writeObject(Writer* writer, Value value) {
   switch (OBJ_TYPE(value)) {
     case OBJ_BOUND_METHOD:
-      return fnToStr(buff, AS_BOUND_METHOD(value)->method->function);
-    case OBJ_CLASS: return asprintf(buff, "%s", AS_CLASS(value)->name->chars);
-    case OBJ_CLOSURE: return fnToStr(buff, AS_CLOSURE(value)->function);
-    case OBJ_FUNCTION: return fnToStr(buff, AS_FUNCTION(value));
+      writeFunction(writer, AS_BOUND_METHOD(value)->method->function);
+      break;
+    case OBJ_CLASS: writeString(writer, AS_CLASS(value)->name); break;
+    case OBJ_CLOSURE:
+      writeFunction(writer, AS_CLOSURE(value)->function);
+      break;
+    case OBJ_FUNCTION: writeFunction(writer, AS_FUNCTION(value)); break;
     case OBJ_INSTANCE:
-      return asprintf(
-          buff, "%s instance", AS_INSTANCE(value)->klass->name->chars);
-    case OBJ_NATIVE: return asprintf(buff, "<native fn>");
-    case OBJ_STRING: return asprintf(buff, "%s", AS_CSTRING(value));
-    case OBJ_UPVALUE: return asprintf(buff, "upvalue");
+      writeString(writer, AS_INSTANCE(value)->klass->name);
+      writeChars(writer, " instance", 9);
+      break;
+    case OBJ_NATIVE: writeChars(writer, "<native fn>", 11); break;
+    case OBJ_ROPE: {
+      ObjRope* rope = AS_ROPE(value);
+      copyRope(rope, reserveChars(writer, rope->length));
+      writer->length += rope->length;
+      break;
+    }
+    case OBJ_SHAPE: writeChars(writer, "shape", 5); break;
+    case OBJ_STRING: writeString(writer, AS_STRING(value)); break;
+    case OBJ_UPVALUE: writeChars(writer, "upvalue", 7); break;
+  }
+}
+
+static ObjShape* shapeTransition(ObjShape* shape, Value name) {
+  Value next;
+  if (tableGet(&shape->transitions, name, &next)) return AS_SHAPE(next);
+  if (shape->slotCount == SHAPE_MAX_SLOTS ||
+      shape->transitions.count == SHAPE_MAX_TRANSITIONS)
+    return NULL;
+
+  ObjShape* child = newShape(shape);
+  push(OBJ_VAL(child));
+  tableAddAll(&shape->slots, &child->slots);
+  rememberObject(&child->obj);
+  tableSet(&child->slots, name, INT_VAL(shape->slotCount));
+  writeBarrier(&child->obj, name);
+  child->slotCount = shape->slotCount + 1;
+  tableSet(&shape->transitions, name, OBJ_VAL(child));
+  writeBarrier(&shape->obj, name);
+  writeBarrier(&shape->obj, OBJ_VAL(child));
+  pop();
+
+  return child;
+}
+
+static void growSlots(ObjInstance* instance) {
+  int capacity = GROW_CAPACITY(instance->slotCapacity);
+  Value* slots = ALLOCATE(Value, capacity);
+  memcpy(slots, instance->slots, sizeof(Value) * instance->shape->slotCount);
+
+  if (instance->slots != instance->inlineSlots)
+    FREE_ARRAY(Value, instance->slots, instance->slotCapacity);
+  PUBLISH(instance->slots, slots);
+  instance->slotCapacity = capacity;
+}
+
+static void makeDictionary(ObjInstance* instance) {
+  ObjShape* shape = instance->shape;
+  Table* fields = ALLOCATE(Table, 1);
+  initTable(fields);
+
+  for (int i = 0; i < shape->slots.capacity; i++) {
+    Entry* entry = &shape->slots.entries[i];
+    if (IS_EMPTY(entry->key)) continue;
+    tableSet(
+        fields, entry->key, instance->slots[AS_INT(entry->value)]);
   }
-  return -1;
+
+  PUBLISH(instance->fields, fields);
+  PUBLISH(instance->shape, NULL);
+  rememberObject(&instance->obj);
+}
+
+int findSlot(ObjShape* shape, Value name) {
+  Value slot;
+  if (!tableGetString(&shape->slots, AS_STRING(name), &slot)) return -1;
+  return AS_INT(slot);
+}
+
+bool instanceGet(ObjInstance* instance, Value name, Value* value) {
+  if (instance->shape == NULL) return tableGet(instance->fields, name, value);
+
+  int slot = findSlot(instance->shape, name);
+  if (slot == -1) return false;
+  if (value != NULL) *value = instance->slots[slot];
+  return true;
+}
+
+static bool setField(ObjInstance* instance, Value name, Value value) {
+  bool isNew = tableSet(instance->fields, name, value);
+  writeBarrier(&instance->obj, name);
+  writeBarrier(&instance->obj, value);
+  return isNew;
+}
+
+bool instanceSet(ObjInstance* instance, Value name, Value value) {
+  if (instance->shape == NULL) return setField(instance, name, value);
+
+  int slot = findSlot(instance->shape, name);
+  if (slot != -1) {
+    PUBLISH(instance->slots[slot], value);
+    writeBarrier(&instance->obj, value);
+    return false;
+  }
+
+  ObjShape* next = shapeTransition(instance->shape, name);
+  if (next == NULL) {
+    makeDictionary(instance);
+    return setField(instance, name, value);
+  }
+
+  if (instance->shape->slotCount == instance->slotCapacity)
+    growSlots(instance);
+  PUBLISH(instance->slots[instance->shape->slotCount], value);
+  PUBLISH(instance->shape, next);
+  writeBarrier(&instance->obj, value);
+  writeBarrier(&instance->obj, OBJ_VAL(next));
+
+  if (instance->klass->instanceSlots < next->slotCount)
+    instance->klass->instanceSlots = next->slotCount;
+  return true;
+}
+
+bool instanceDelete(ObjInstance* instance, Value name) {
+  if (instance->shape != NULL) {
+    if (findSlot(instance->shape, name) == -1) return false;
+    makeDictionary(instance);
+  }
+
+  return tableDelete(instance->fields, name);
 }
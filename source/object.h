@@ -8,12 +8,16 @@
 
 #define OBJ_TYPE(value) (AS_OBJ(value)->type)
 
+#define CALLSITE_ENTRIES 4
+
 #define IS_BOUND_METHOD(value) isObjType(value, OBJ_BOUND_METHOD)
 #define IS_CLASS(value) isObjType(value, OBJ_CLASS)
 #define IS_CLOSURE(value) isObjType(value, OBJ_CLOSURE)
 #define IS_FUNCTION(value) isObjType(value, OBJ_FUNCTION)
 #define IS_INSTANCE(value) isObjType(value, OBJ_INSTANCE)
 #define IS_NATIVE(value) isObjType(value, OBJ_NATIVE)
+#define IS_ROPE(value) isObjType(value, OBJ_ROPE)
+#define IS_SHAPE(value) isObjType(value, OBJ_SHAPE)
 #define IS_STRING(value) isObjType(value, OBJ_STRING)
 
 #define AS_BOUND_METHOD(value) ((ObjBoundMethod*)AS_OBJ(value))
@@ -22,6 +26,8 @@
 #define AS_FUNCTION(value) ((ObjFunction*)AS_OBJ(value))
 #define AS_INSTANCE(value) ((ObjInstance*)AS_OBJ(value))
 #define AS_NATIVE(value) (((ObjNative*)AS_OBJ(value))->function)
+#define AS_ROPE(value) ((ObjRope*)AS_OBJ(value))
+#define AS_SHAPE(value) ((ObjShape*)AS_OBJ(value))
 #define AS_STRING(value) ((ObjString*)AS_OBJ(value))
 #define AS_CSTRING(value) (((ObjString*)AS_OBJ(value))->chars)
 
@@ -32,14 +38,17 @@ typedef enum {
   OBJ_FUNCTION,
   OBJ_INSTANCE,
   OBJ_NATIVE,
+  OBJ_ROPE,
+  OBJ_SHAPE,
   OBJ_STRING,
   OBJ_UPVALUE
 } ObjType;
 
 struct Obj {
-  ObjType type;
-  bool isMarked;
-  struct Obj* next;
+  uint8_t type;
+  bool isOld;
+  bool isRemembered;
+  bool inPage;
 };
 
 typedef struct {
@@ -64,6 +73,13 @@ struct ObjString {
   char chars[];
 };
 
+typedef struct {
+  Obj obj;
+  int length;
+  Value left;
+  Value right;
+} ObjRope;
+
 typedef struct ObjUpvalue {
   Obj obj;
   Value* location;
@@ -78,22 +94,58 @@ typedef struct {
   int upvalueCount;
 } ObjClosure;
 
+typedef struct ObjShape {
+  Obj obj;
+  struct ObjShape* parent;
+  int slotCount;
+  Table slots;
+  Table transitions;
+} ObjShape;
+
 typedef struct {
   Obj obj;
   ObjString* name;
   Value initializer;
   Table methods;
+  ObjShape* shape;
+  int instanceSlots;
 } ObjClass;
 
+typedef struct {
+  Obj* key;
+  ObjClosure* method;
+} CallsiteEntry;
+
 struct Callsite {
-  ObjClass* klass;
+  int count;
+  bool megamorphic;
+  CallsiteEntry entries[CALLSITE_ENTRIES];
+#ifdef DEBUG_LOG_CACHE
+  int hits;
+  int misses;
+#endif
+};
+
+struct PropertyCache {
+  ObjShape* shape;
+  ObjShape* transition;
   ObjClosure* method;
+  int slot;
+#ifdef DEBUG_LOG_CACHE
+  int hits;
+  int misses;
+#endif
 };
 
 typedef struct {
   Obj obj;
   ObjClass* klass;
-  Table fields;
+  ObjShape* shape;
+  Value* slots;
+  int slotCapacity;
+  int inlineCapacity;
+  Table* fields;
+  Value inlineSlots[];
 } ObjInstance;
 
 typedef struct {
@@ -108,15 +160,35 @@ ObjClosure* newClosure(ObjFunction* function);
 ObjFunction* newFunction();
 ObjInstance* newInstance(ObjClass* klass);
 ObjNative* newNative(NativeFn function);
+ObjRope* newRope(Value left, Value right, int length);
+void copyRope(ObjRope* rope, char* chars);
+ObjString* flattenRope(ObjRope* rope);
+void copyChars(Value value, char* chars);
+Value stringValue(const char* chars, int length);
+ObjString* heapString(Value value);
+ObjShape* newShape(ObjShape* parent);
 ObjString* allocateString(int length);
-uint32_t hashString(const char* key, int length);
 ObjString* takeString(char* chars, int length);
 ObjString* copyString(const char* chars, int length);
+ObjString* internString(ObjString* string);
 ObjUpvalue* newUpvalue(Value* slot);
-int objToStr(char** buff, Value value);
+void writeObject(Writer* writer, Value value);
+int findSlot(ObjShape* shape, Value name);
+bool instanceGet(ObjInstance* instance, Value name, Value* value);
+bool instanceSet(ObjInstance* instance, Value name, Value value);
+bool instanceDelete(ObjInstance* instance, Value name);
 
 static inline bool isObjType(Value value, ObjType type) {
   return IS_OBJ(value) && OBJ_TYPE(value) == type;
 }
 
+static inline bool isString(Value value) {
+  return IS_SMALL_STRING(value) || IS_STRING(value) || IS_ROPE(value);
+}
+
+static inline int stringLength(Value value) {
+  if (IS_SMALL_STRING(value)) return SMALL_STRING_LENGTH(value);
+  return IS_ROPE(value) ? AS_ROPE(value)->length : AS_STRING(value)->length;
+}
+
 #endif
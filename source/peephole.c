@@ -0,0 +1,569 @@
+#include "peephole.h"
+
+#include "memory.h"
+#include "slots.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define PASSES_MAX 8
+#define HOPS_MAX 16
+
+typedef struct {
+  OpCode op;
+  int offset;
+  int length;
+  int line;
+  int target;
+  int position;
+  bool live;
+} Instruction;
+
+typedef struct {
+  Chunk* chunk;
+  Instruction* code;
+  int count;
+  bool* isTarget;
+  int* depths;
+  int* work;
+  int* targets;
+  int caseCount;
+} Peephole;
+
+static uint16_t readShort(const uint8_t* bytes) {
+  return (uint16_t)(bytes[0] | bytes[1] << 8);
+}
+
+static void writeShort(uint8_t* bytes, int value) {
+  bytes[0] = (uint8_t)(value & 0xFF);
+  bytes[1] = (uint8_t)((value >> 8) & 0xFF);
+}
+
+static int instructionLength(Chunk* chunk, int offset) {
+  switch (chunk->code[offset]) {
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_GET_UPVALUE:
+    case OP_SET_UPVALUE:
+    case OP_CALL:
+    case OP_BUILD_STRING: return 2;
+    case OP_CONSTANT:
+    case OP_GET_GLOBAL:
+    case OP_DEFINE_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_GET_SUPER:
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_LOOP:
+    case OP_CLASS:
+    case OP_METHOD:
+    case OP_SWITCH:
+    case OP_POP_JUMP_IF_FALSE:
+    case OP_JUMP_IF_NOT_EQUAL:
+    case OP_JUMP_IF_EQUAL:
+    case OP_JUMP_IF_NOT_GREATER:
+    case OP_JUMP_IF_NOT_GREATER_EQUAL:
+    case OP_JUMP_IF_NOT_LESS:
+    case OP_JUMP_IF_NOT_LESS_EQUAL: return 3;
+    case OP_GET_PROPERTY:
+    case OP_SET_PROPERTY: return 5;
+    case OP_INVOKE:
+    case OP_SUPER_INVOKE: return 6;
+    case OP_CLOSURE: {
+      Value constant =
+          chunk->constants.values[readShort(&chunk->code[offset + 1])];
+      return 3 + 2 * AS_FUNCTION(constant)->upvalueCount;
+    }
+    default: return 1;
+  }
+}
+
+static bool isJump(OpCode op) {
+  switch (op) {
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_LOOP:
+    case OP_POP_JUMP_IF_FALSE:
+    case OP_JUMP_IF_NOT_EQUAL:
+    case OP_JUMP_IF_EQUAL:
+    case OP_JUMP_IF_NOT_GREATER:
+    case OP_JUMP_IF_NOT_GREATER_EQUAL:
+    case OP_JUMP_IF_NOT_LESS:
+    case OP_JUMP_IF_NOT_LESS_EQUAL: return true;
+    default: return false;
+  }
+}
+
+// The branch a comparison and the OP_POP_JUMP_IF_FALSE after it fuse
+// into, or OP_POP_JUMP_IF_FALSE if there isn't one.
+static OpCode fusedBranch(OpCode op) {
+  switch (op) {
+    case OP_EQUAL: return OP_JUMP_IF_NOT_EQUAL;
+    case OP_NOT_EQUAL: return OP_JUMP_IF_EQUAL;
+    case OP_GREATER: return OP_JUMP_IF_NOT_GREATER;
+    case OP_GREATER_EQUAL: return OP_JUMP_IF_NOT_GREATER_EQUAL;
+    case OP_LESS: return OP_JUMP_IF_NOT_LESS;
+    case OP_LESS_EQUAL: return OP_JUMP_IF_NOT_LESS_EQUAL;
+    default: return OP_POP_JUMP_IF_FALSE;
+  }
+}
+
+static bool endsBlock(OpCode op) {
+  return op == OP_JUMP || op == OP_LOOP || op == OP_RETURN ||
+         op == OP_SWITCH;
+}
+
+static bool isPurePush(OpCode op) {
+  switch (op) {
+    case OP_CONSTANT:
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_GET_LOCAL:
+    case OP_GET_UPVALUE:
+    case OP_GET_THIS:
+    case OP_DUP:
+    case OP_CONSTANT_NEGATIVE_ONE:
+    case OP_CONSTANT_ZERO:
+    case OP_CONSTANT_ONE:
+    case OP_CONSTANT_TWO:
+    case OP_CONSTANT_THREE:
+    case OP_CONSTANT_FOUR:
+    case OP_CONSTANT_FIVE: return true;
+    default: return false;
+  }
+}
+
+// Pool constants are numbers, strings and functions, all of them truthy.
+static bool isConstant(OpCode op, bool* truthy) {
+  *truthy = op != OP_NIL && op != OP_FALSE;
+  return op == OP_NIL || op == OP_FALSE ||
+         (op != OP_GET_LOCAL && op != OP_GET_UPVALUE && op != OP_GET_THIS &&
+          op != OP_DUP && isPurePush(op));
+}
+
+static SwitchTable* switchOf(Peephole* p, Instruction* instruction) {
+  Chunk* chunk = p->chunk;
+  return &chunk->switches[readShort(&chunk->code[instruction->offset + 1])];
+}
+
+static int next(Peephole* p, int index) {
+  do {
+    index++;
+  } while (index < p->count && !p->code[index].live);
+  return index;
+}
+
+static int resolve(Peephole* p, int index) {
+  return p->code[index].live ? index : next(p, index);
+}
+
+// Collects where an instruction can jump to, besides the next one.
+static int targetsOf(Peephole* p, int index, int* targets) {
+  Instruction* instruction = &p->code[index];
+  if (instruction->op != OP_SWITCH) {
+    if (instruction->target == -1) return 0;
+    targets[0] = resolve(p, instruction->target);
+    return 1;
+  }
+
+  SwitchTable* table = switchOf(p, instruction);
+  int count = 0;
+  targets[count++] = resolve(p, table->miss);
+  for (int i = 0; i < table->length; i++) {
+    if (table->offsets[i] != -1)
+      targets[count++] = resolve(p, table->offsets[i]);
+  }
+  for (int i = 0; i < table->cases.capacity; i++) {
+    Entry* entry = &table->cases.entries[i];
+    if (!IS_EMPTY(entry->key))
+      targets[count++] = resolve(p, AS_INT(entry->value));
+  }
+  return count;
+}
+
+// Anything jumping to a removed instruction lands on the one after it.
+static void removeInstruction(Peephole* p, int index) {
+  p->code[index].live = false;
+  if (p->isTarget[index]) {
+    int after = next(p, index);
+    if (after < p->count) p->isTarget[after] = true;
+  }
+}
+
+// Switch tables hold instruction numbers from here until emit() turns
+// them back into offsets.
+static void decodeSwitch(
+    Peephole* p, int* indices, Instruction* instruction) {
+  SwitchTable* table = switchOf(p, instruction);
+  int* from = &indices[instruction->offset + 3];
+  table->miss = from[table->miss];
+  for (int i = 0; i < table->length; i++) {
+    if (table->offsets[i] != -1) table->offsets[i] = from[table->offsets[i]];
+  }
+  for (int i = 0; i < table->cases.capacity; i++) {
+    Entry* entry = &table->cases.entries[i];
+    if (!IS_EMPTY(entry->key))
+      PUBLISH(entry->value, INT_VAL(from[AS_INT(entry->value)]));
+  }
+  p->caseCount += 1 + table->length + table->cases.count;
+}
+
+static bool decode(Peephole* p) {
+  Chunk* chunk = p->chunk;
+  int* indices = ALLOCATE(int, chunk->count);
+  for (int offset = 0; offset < chunk->count; offset++) indices[offset] = -1;
+
+  p->count = 0;
+  for (int offset = 0; offset < chunk->count;) {
+    Instruction* instruction = &p->code[p->count];
+    instruction->op = (OpCode)chunk->code[offset];
+    instruction->offset = offset;
+    instruction->length = instructionLength(chunk, offset);
+    instruction->line = getLine(chunk, offset);
+    instruction->target = -1;
+    instruction->live = true;
+    indices[offset] = p->count++;
+    offset += instruction->length;
+  }
+
+  bool valid = true;
+  for (int i = 0; i < p->count; i++) {
+    Instruction* instruction = &p->code[i];
+    if (!isJump(instruction->op)) continue;
+
+    int jump = readShort(&chunk->code[instruction->offset + 1]);
+    int target = instruction->offset + 3 +
+                 (instruction->op == OP_LOOP ? -jump : jump);
+    if (target < 0 || target >= chunk->count || indices[target] == -1) {
+      valid = false;
+      break;
+    }
+    instruction->target = indices[target];
+  }
+
+  p->caseCount = 0;
+  for (int i = 0; valid && i < p->count; i++) {
+    if (p->code[i].op == OP_SWITCH) decodeSwitch(p, indices, &p->code[i]);
+  }
+
+  FREE_ARRAY(int, indices, chunk->count);
+  return valid;
+}
+
+// Conditional jumps only go forward, and every jump must still fit its
+// operand once threaded.
+static bool canJump(Peephole* p, int from, int to) {
+  int distance = p->code[to].offset - p->code[from].offset - 3;
+  OpCode op = p->code[from].op;
+  if (op != OP_JUMP && op != OP_LOOP && distance < 0) return false;
+  return abs(distance) <= UINT16_MAX;
+}
+
+// Jumps to unconditional jumps go straight to their destination, and a
+// failed test jumping to the same test skips ahead, since the value it
+// looked at is still on the stack. Branches that pop their operands
+// only ever follow unconditional jumps.
+static bool threadJumps(Peephole* p) {
+  bool changed = false;
+  for (int i = 0; i < p->count; i++) {
+    Instruction* jump = &p->code[i];
+    if (!jump->live || jump->target == -1) continue;
+
+    int target = resolve(p, jump->target);
+    for (int hops = 0; hops < HOPS_MAX; hops++) {
+      Instruction* hop = &p->code[target];
+      bool follows = hop->op == OP_JUMP || hop->op == OP_LOOP ||
+                     (jump->op == OP_JUMP_IF_FALSE &&
+                      hop->op == OP_JUMP_IF_FALSE);
+      if (!follows) break;
+
+      int destination = resolve(p, hop->target);
+      if (destination == i || !canJump(p, i, destination)) break;
+      target = destination;
+    }
+
+    if (target != jump->target) changed = true;
+    jump->target = target;
+  }
+  return changed;
+}
+
+static bool removeUnreachable(Peephole* p) {
+  bool* seen = p->isTarget;
+  memset(seen, 0, sizeof(bool) * p->count);
+
+  int pending = 0;
+  p->work[pending++] = resolve(p, 0);
+  while (pending > 0) {
+    int i = p->work[--pending];
+    if (i == p->count || seen[i]) continue;
+    seen[i] = true;
+
+    Instruction* instruction = &p->code[i];
+    pending += targetsOf(p, i, &p->work[pending]);
+    if (!endsBlock(instruction->op)) p->work[pending++] = next(p, i);
+  }
+
+  bool changed = false;
+  for (int i = 0; i < p->count; i++) {
+    if (p->code[i].live && !seen[i]) {
+      p->code[i].live = false;
+      changed = true;
+    }
+  }
+  return changed;
+}
+
+static uint8_t operand(Peephole* p, int index) {
+  return p->chunk->code[p->code[index].offset + 1];
+}
+
+static bool rewrite(Peephole* p, int i) {
+  Instruction* first = &p->code[i];
+  int j = next(p, i);
+  if (j == p->count) return false;
+
+  if ((first->op == OP_JUMP || first->op == OP_JUMP_IF_FALSE) &&
+      resolve(p, first->target) == j) {
+    removeInstruction(p, i);
+    return true;
+  }
+
+  if (first->op == OP_POP_JUMP_IF_FALSE && resolve(p, first->target) == j) {
+    first->op = OP_POP;
+    first->length = 1;
+    first->target = -1;
+    return true;
+  }
+
+  Instruction* second = &p->code[j];
+  if (p->isTarget[j]) return false;
+
+  if (isPurePush(first->op) && second->op == OP_POP) {
+    removeInstruction(p, i);
+    removeInstruction(p, j);
+    return true;
+  }
+
+  if (first->op == OP_GET_LOCAL && second->op == OP_SET_LOCAL &&
+      operand(p, i) == operand(p, j)) {
+    removeInstruction(p, j);
+    return true;
+  }
+
+  bool truthy;
+  if (isConstant(first->op, &truthy) && second->op == OP_JUMP_IF_FALSE) {
+    if (truthy)
+      removeInstruction(p, j);
+    else
+      second->op = OP_JUMP;
+    return true;
+  }
+
+  if (isConstant(first->op, &truthy) &&
+      second->op == OP_POP_JUMP_IF_FALSE) {
+    removeInstruction(p, i);
+    if (truthy)
+      removeInstruction(p, j);
+    else
+      second->op = OP_JUMP;
+    return true;
+  }
+
+  if (second->op == OP_POP_JUMP_IF_FALSE &&
+      fusedBranch(first->op) != OP_POP_JUMP_IF_FALSE) {
+    second->op = fusedBranch(first->op);
+    removeInstruction(p, i);
+    return true;
+  }
+
+  int k = next(p, j);
+  if (first->op == OP_SET_LOCAL && second->op == OP_POP && k < p->count &&
+      !p->isTarget[k] && p->code[k].op == OP_GET_LOCAL &&
+      operand(p, i) == operand(p, k)) {
+    removeInstruction(p, j);
+    removeInstruction(p, k);
+    return true;
+  }
+
+  return false;
+}
+
+static bool rewritePatterns(Peephole* p) {
+  memset(p->isTarget, 0, sizeof(bool) * p->count);
+  for (int i = 0; i < p->count; i++) {
+    if (!p->code[i].live) continue;
+    int count = targetsOf(p, i, p->targets);
+    for (int t = 0; t < count; t++) p->isTarget[p->targets[t]] = true;
+  }
+
+  bool changed = false;
+  for (int i = resolve(p, 0); i < p->count; i = next(p, i)) {
+    while (p->code[i].live && rewrite(p, i)) changed = true;
+  }
+  return changed;
+}
+
+static SlotUsage stackEffect(Peephole* p, Instruction* instruction) {
+  const uint8_t* bytes = &p->chunk->code[instruction->offset];
+  SlotUsage usage = getUsage(instruction->op);
+  switch (instruction->op) {
+    case OP_CALL:
+    case OP_BUILD_STRING: usage.delta -= bytes[1]; break;
+    case OP_INVOKE:
+    case OP_SUPER_INVOKE: usage.delta -= bytes[3]; break;
+    default: break;
+  }
+  return usage;
+}
+
+// Every path into an instruction must agree on the stack depth. If one
+// doesn't, the compiler's own running count is kept.
+static void countSlots(Peephole* p) {
+  for (int i = 0; i < p->count; i++) p->depths[i] = -1;
+
+  int peak = 0;
+  int pending = 0;
+  int entry = resolve(p, 0);
+  p->depths[entry] = 0;
+  p->work[pending++] = entry;
+  while (pending > 0) {
+    int i = p->work[--pending];
+    Instruction* instruction = &p->code[i];
+    SlotUsage usage = stackEffect(p, instruction);
+    int depth = p->depths[i];
+    if (depth + usage.peak > peak) peak = depth + usage.peak;
+
+    depth += usage.delta;
+    if (depth < 0) return;
+
+    int* successors = p->targets;
+    int successorCount = targetsOf(p, i, successors);
+    if (!endsBlock(instruction->op)) successors[successorCount++] = next(p, i);
+
+    for (int s = 0; s < successorCount; s++) {
+      int successor = successors[s];
+      if (successor == p->count) continue;
+      if (p->depths[successor] == -1) {
+        p->depths[successor] = depth;
+        p->work[pending++] = successor;
+      } else if (p->depths[successor] != depth) {
+        return;
+      }
+    }
+  }
+
+  p->chunk->slots = peak;
+}
+
+static void writeLine(Chunk* chunk, int offset, int line) {
+  if (chunk->lineCount > 0 && chunk->lines[chunk->lineCount - 1].line == line)
+    return;
+  chunk->lines[chunk->lineCount].offset = offset;
+  chunk->lines[chunk->lineCount].line = line;
+  chunk->lineCount++;
+}
+
+static int caseOffset(Peephole* p, int from, int target) {
+  return p->code[resolve(p, target)].position - from;
+}
+
+static void encodeSwitch(Peephole* p, Instruction* instruction) {
+  SwitchTable* table = switchOf(p, instruction);
+  int from = instruction->position + 3;
+  table->miss = caseOffset(p, from, table->miss);
+  for (int i = 0; i < table->length; i++) {
+    if (table->offsets[i] != -1)
+      table->offsets[i] = caseOffset(p, from, table->offsets[i]);
+  }
+  for (int i = 0; i < table->cases.capacity; i++) {
+    Entry* entry = &table->cases.entries[i];
+    if (!IS_EMPTY(entry->key))
+      PUBLISH(
+          entry->value, INT_VAL(caseOffset(p, from, AS_INT(entry->value))));
+  }
+}
+
+// Compacts the chunk in place. Instructions only ever move backwards, and
+// inline caches are renumbered in order so the dead ones are dropped.
+static void emit(Peephole* p) {
+  Chunk* chunk = p->chunk;
+  int position = 0;
+  for (int i = 0; i < p->count; i++) {
+    p->code[i].position = position;
+    if (p->code[i].live) position += p->code[i].length;
+  }
+
+  for (int i = 0; i < p->count; i++) {
+    if (p->code[i].op == OP_SWITCH) encodeSwitch(p, &p->code[i]);
+  }
+
+  int callsiteCount = 0;
+  int cacheCount = 0;
+  chunk->count = 0;
+  chunk->lineCount = 0;
+  for (int i = 0; i < p->count; i++) {
+    Instruction* instruction = &p->code[i];
+    if (!instruction->live) continue;
+
+    uint8_t* bytes = &chunk->code[instruction->position];
+    memmove(bytes, &chunk->code[instruction->offset], instruction->length);
+    bytes[0] = (uint8_t)instruction->op;
+    writeLine(chunk, instruction->position, instruction->line);
+    chunk->count += instruction->length;
+
+    if (isJump(instruction->op)) {
+      int target = p->code[resolve(p, instruction->target)].position;
+      int from = instruction->position + 3;
+      if (target >= from) {
+        if (instruction->op == OP_LOOP) bytes[0] = OP_JUMP;
+        writeShort(&bytes[1], target - from);
+      } else {
+        bytes[0] = OP_LOOP;
+        writeShort(&bytes[1], from - target);
+      }
+    }
+
+    switch (instruction->op) {
+      case OP_GET_PROPERTY:
+      case OP_SET_PROPERTY: writeShort(&bytes[3], cacheCount++); break;
+      case OP_INVOKE:
+      case OP_SUPER_INVOKE: writeShort(&bytes[4], callsiteCount++); break;
+      default: break;
+    }
+  }
+
+  PUBLISH(chunk->callsiteCount, callsiteCount);
+  PUBLISH(chunk->cacheCount, cacheCount);
+}
+
+void optimizeChunk(Chunk* chunk) {
+  int count = chunk->count;
+  if (count == 0) return;
+
+  Peephole p;
+  p.chunk = chunk;
+  p.code = ALLOCATE(Instruction, count);
+  p.isTarget = ALLOCATE(bool, count);
+  p.depths = ALLOCATE(int, count);
+
+  if (decode(&p)) {
+    p.work = ALLOCATE(int, 2 * count + p.caseCount + 1);
+    p.targets = ALLOCATE(int, p.caseCount + 2);
+    for (int pass = 0; pass < PASSES_MAX; pass++) {
+      bool changed = threadJumps(&p);
+      changed |= removeUnreachable(&p);
+      changed |= rewritePatterns(&p);
+      if (!changed) break;
+    }
+    countSlots(&p);
+    emit(&p);
+    FREE_ARRAY(int, p.targets, p.caseCount + 2);
+    FREE_ARRAY(int, p.work, 2 * count + p.caseCount + 1);
+  }
+
+  FREE_ARRAY(int, p.depths, count);
+  FREE_ARRAY(bool, p.isTarget, count);
+  FREE_ARRAY(Instruction, p.code, count);
+}
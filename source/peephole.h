@@ -0,0 +1,8 @@
+#ifndef CLOX_PEEPHOLE_H
+#define CLOX_PEEPHOLE_H
+
+#include "chunk.h"
+
+void optimizeChunk(Chunk* chunk);
+
+#endif
@@ -8,15 +8,17 @@
 typedef struct {
   const char* start;
   const char* current;
+  const char* end;
   int interps;
   int line;
 } Scanner;
 
 Scanner scanner;
 
-void initScanner(const char* source) {
+void initScanner(const char* source, size_t length) {
   scanner.start = source;
   scanner.current = source;
+  scanner.end = source + length;
   scanner.interps = 0;
   scanner.line = 1;
 }
@@ -30,7 +32,7 @@ static bool isDigit(char c) {
 }
 
 static bool isAtEnd() {
-  return *scanner.current == '\0';
+  return scanner.current == scanner.end;
 }
 
 static char advance() {
@@ -39,11 +41,12 @@ static char advance() {
 }
 
 static char peek() {
+  if (isAtEnd()) return '\0';
   return *scanner.current;
 }
 
 static char peekNext() {
-  if (isAtEnd()) return '\0';
+  if (scanner.end - scanner.current < 2) return '\0';
   return scanner.current[1];
 }
 
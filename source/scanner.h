@@ -1,6 +1,8 @@
 #ifndef CLOX_SCANNER_H
 #define CLOX_SCANNER_H
 
+#include <stddef.h>
+
 typedef enum {
   TOKEN_LEFT_PAREN,
   TOKEN_RIGHT_PAREN,
@@ -58,7 +60,7 @@ typedef struct {
   int line;
 } Token;
 
-void initScanner(const char* source);
+void initScanner(const char* source, size_t length);
 Token scanToken();
 
 #endif
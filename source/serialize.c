@@ -0,0 +1,269 @@
+#include "serialize.h"
+
+#include "hash.h"
+#include "memory.h"
+#include "vm.h"
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+void writeByte(Writer* out, uint8_t byte) {
+  writeChars(out, (const char*)&byte, 1);
+}
+
+void writeInt(Writer* out, int32_t value) {
+  writeChars(out, (const char*)&value, sizeof(value));
+}
+
+void writeCounted(Writer* out, const char* chars, int length) {
+  writeInt(out, length);
+  writeChars(out, chars, length);
+}
+
+void writeGlobalNames(Writer* out) {
+  int count = vm.globalValues.count;
+  ObjString** names = (ObjString**)calloc(count, sizeof(ObjString*));
+  if (names == NULL) exit(1);
+
+  for (int i = 0; i < vm.globalNames.capacity; i++) {
+    Entry* entry = &vm.globalNames.entries[i];
+    if (IS_EMPTY(entry->key)) continue;
+    names[AS_INT(entry->value)] = AS_STRING(entry->key);
+  }
+
+  writeInt(out, count);
+  for (int i = 0; i < count; i++)
+    writeCounted(out, names[i]->chars, names[i]->length);
+  free(names);
+}
+
+// Everything about a function except the objects it refers to. Inline
+// caches are not worth keeping, so only their counts are written.
+void writeCode(Writer* out, ObjFunction* function) {
+  Chunk* chunk = &function->chunk;
+  writeInt(out, function->arity);
+  writeInt(out, function->upvalueCount);
+  writeInt(out, chunk->slots);
+
+  writeInt(out, chunk->count);
+  writeChars(out, (const char*)chunk->code, chunk->count);
+  writeInt(out, chunk->lineCount);
+  writeChars(
+      out, (const char*)chunk->lines,
+      chunk->lineCount * (int)sizeof(LineStart));
+  writeInt(out, chunk->callsiteCount);
+  writeInt(out, chunk->cacheCount);
+
+  writeInt(out, chunk->switchCount);
+  for (int i = 0; i < chunk->switchCount; i++) {
+    SwitchTable* table = &chunk->switches[i];
+    writeInt(out, table->miss);
+    writeInt(out, table->low);
+    writeInt(out, table->length);
+    if (table->length > 0)
+      writeChars(
+          out, (const char*)table->offsets,
+          table->length * (int)sizeof(int));
+  }
+}
+
+// Writes beside the destination and renames over it so concurrent runs
+// never load a partial file. A trailing checksum lets loadFile reject a
+// corrupted file, since the loaders trust the code and operands they read.
+bool saveFile(const char* path, Writer* out) {
+  int length = out->length;
+  writeInt(out, (int32_t)hashString(out->chars, length));
+
+  size_t pathLength = strlen(path) + 16;
+  char* tempPath = (char*)malloc(pathLength);
+  if (tempPath == NULL) exit(1);
+  snprintf(tempPath, pathLength, "%s.%d", path, (int)getpid());
+
+  bool saved = false;
+  FILE* file = fopen(tempPath, "wb");
+  if (file != NULL) {
+    saved = fwrite(out->chars, 1, out->length, file) == (size_t)out->length;
+    if (fclose(file) != 0) saved = false;
+    if (saved && rename(tempPath, path) != 0) saved = false;
+    if (!saved) remove(tempPath);
+  }
+
+  free(tempPath);
+  out->length = length;
+  return saved;
+}
+
+char* loadFile(const char* path, int* length) {
+  FILE* file = fopen(path, "rb");
+  if (file == NULL) return NULL;
+
+  fseek(file, 0L, SEEK_END);
+  long fileSize = ftell(file);
+  rewind(file);
+
+  char* buffer =
+      fileSize > 0 && fileSize <= INT_MAX ? (char*)malloc(fileSize) : NULL;
+  bool read = buffer != NULL &&
+              fread(buffer, 1, fileSize, file) == (size_t)fileSize;
+  fclose(file);
+
+  int32_t checksum = 0;
+  int contents = (int)fileSize - (int)sizeof(checksum);
+  if (read && contents >= 0) {
+    memcpy(&checksum, buffer + contents, sizeof(checksum));
+    read = checksum == (int32_t)hashString(buffer, contents);
+  } else {
+    read = false;
+  }
+  if (!read) {
+    free(buffer);
+    return NULL;
+  }
+
+  *length = contents;
+  return buffer;
+}
+
+const char* readChars(Reader* in, int length) {
+  if (in->failed || length < 0 || in->end - in->current < length) {
+    in->failed = true;
+    return NULL;
+  }
+
+  const char* chars = in->current;
+  in->current += length;
+  return chars;
+}
+
+void readBytes(Reader* in, void* bytes, int length) {
+  const char* chars = readChars(in, length);
+  if (chars != NULL) memcpy(bytes, chars, length);
+}
+
+uint8_t readByte(Reader* in) {
+  uint8_t byte = 0;
+  readBytes(in, &byte, 1);
+  return byte;
+}
+
+int32_t readInt(Reader* in) {
+  int32_t value = 0;
+  readBytes(in, &value, sizeof(value));
+  return value;
+}
+
+const char* readCounted(Reader* in, int* length) {
+  *length = readInt(in);
+  return readChars(in, *length);
+}
+
+int remaining(Reader* in) {
+  return (int)(in->end - in->current);
+}
+
+int readCount(Reader* in, int limit) {
+  int32_t count = readInt(in);
+  if (count < 0 || count > limit) in->failed = true;
+  return in->failed ? 0 : count;
+}
+
+bool readHeader(Reader* in, Writer* header) {
+  const char* stored = readChars(in, header->length);
+  return stored != NULL &&
+         memcmp(stored, header->chars, header->length) == 0;
+}
+
+// Global slots are compiled into the code, so every name must land on the
+// index it was written with. Names this process has not seen yet are
+// appended in order.
+bool readGlobalNames(Reader* in) {
+  int count = readCount(in, remaining(in));
+  for (int i = 0; i < count; i++) {
+    int length;
+    const char* chars = readCounted(in, &length);
+    if (chars == NULL) return false;
+
+    Value name = OBJ_VAL(copyString(chars, length));
+    Value index;
+    bool matches = true;
+    push(name);
+    if (tableGet(&vm.globalNames, name, &index)) {
+      matches = AS_INT(index) == i;
+    } else if (vm.globalValues.count == i) {
+      writeValueArray(&vm.globalValues, UNDEFINED_VAL);
+      tableSet(&vm.globalNames, name, INT_VAL(i));
+    } else {
+      matches = false;
+    }
+    pop();
+    if (!matches) return false;
+  }
+  return !in->failed;
+}
+
+void readCode(Reader* in, ObjFunction* function) {
+  Chunk* chunk = &function->chunk;
+  function->arity = readInt(in);
+  function->upvalueCount = readInt(in);
+  chunk->slots = readInt(in);
+
+  int count = readCount(in, remaining(in));
+  chunk->code = ALLOCATE(uint8_t, count);
+  chunk->capacity = count;
+  readBytes(in, chunk->code, count);
+  chunk->count = count;
+
+  count = readCount(in, remaining(in) / (int)sizeof(LineStart));
+  chunk->lines = ALLOCATE(LineStart, count);
+  chunk->lineCapacity = count;
+  readBytes(in, chunk->lines, count * (int)sizeof(LineStart));
+  chunk->lineCount = count;
+
+  count = readCount(in, UINT16_COUNT);
+  PUBLISH(chunk->callsites, ALLOCATE(Callsite, count));
+  chunk->callsiteCapacity = count;
+  for (int i = 0; i < count; i++) {
+    chunk->callsites[i].count = 0;
+    chunk->callsites[i].megamorphic = false;
+#ifdef DEBUG_LOG_CACHE
+    chunk->callsites[i].hits = 0;
+    chunk->callsites[i].misses = 0;
+#endif
+  }
+  PUBLISH(chunk->callsiteCount, count);
+
+  count = readCount(in, UINT16_COUNT);
+  PUBLISH(chunk->caches, ALLOCATE(PropertyCache, count));
+  chunk->cacheCapacity = count;
+  for (int i = 0; i < count; i++) {
+    chunk->caches[i].shape = NULL;
+    chunk->caches[i].transition = NULL;
+    chunk->caches[i].method = NULL;
+    chunk->caches[i].slot = -1;
+#ifdef DEBUG_LOG_CACHE
+    chunk->caches[i].hits = 0;
+    chunk->caches[i].misses = 0;
+#endif
+  }
+  PUBLISH(chunk->cacheCount, count);
+
+  count = readCount(in, UINT16_COUNT);
+  PUBLISH(chunk->switches, ALLOCATE(SwitchTable, count));
+  chunk->switchCapacity = count;
+  for (int i = 0; i < count && !in->failed; i++) {
+    SwitchTable* table = &chunk->switches[i];
+    table->miss = readInt(in);
+    table->low = readInt(in);
+    table->length = readCount(in, remaining(in) / (int)sizeof(int));
+    table->offsets = NULL;
+    if (table->length > 0) {
+      table->offsets = ALLOCATE(int, table->length);
+      readBytes(in, table->offsets, table->length * (int)sizeof(int));
+    }
+    initTable(&table->cases);
+    PUBLISH(chunk->switchCount, chunk->switchCount + 1);
+  }
+}
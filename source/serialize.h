@@ -0,0 +1,31 @@
+#ifndef CLOX_SERIALIZE_H
+#define CLOX_SERIALIZE_H
+
+#include "object.h"
+
+typedef struct {
+  const char* current;
+  const char* end;
+  bool failed;
+} Reader;
+
+void writeByte(Writer* out, uint8_t byte);
+void writeInt(Writer* out, int32_t value);
+void writeCounted(Writer* out, const char* chars, int length);
+void writeGlobalNames(Writer* out);
+void writeCode(Writer* out, ObjFunction* function);
+bool saveFile(const char* path, Writer* out);
+
+char* loadFile(const char* path, int* length);
+const char* readChars(Reader* in, int length);
+void readBytes(Reader* in, void* bytes, int length);
+uint8_t readByte(Reader* in);
+int32_t readInt(Reader* in);
+const char* readCounted(Reader* in, int* length);
+int remaining(Reader* in);
+int readCount(Reader* in, int limit);
+bool readHeader(Reader* in, Writer* header);
+bool readGlobalNames(Reader* in);
+void readCode(Reader* in, ObjFunction* function);
+
+#endif
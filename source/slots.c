@@ -55,6 +55,19 @@ SlotUsage getUsage(OpCode op) {
     case OP_LESS_EQUAL: return (SlotUsage){-1, 0};
     case OP_GET_THIS: return (SlotUsage){1, 1};
     case OP_DUP: return (SlotUsage){1, 1};
+    case OP_ADD_NUM: return (SlotUsage){-1, 0};
+    case OP_ADD_STR: return (SlotUsage){-1, 1};
+    case OP_EQUAL_NUM: return (SlotUsage){-1, 0};
+    case OP_NOT_EQUAL_NUM: return (SlotUsage){-1, 0};
+    case OP_BUILD_STRING: return (SlotUsage){1, 1};
+    case OP_SWITCH: return (SlotUsage){0, 0};
+    case OP_POP_JUMP_IF_FALSE: return (SlotUsage){-1, 0};
+    case OP_JUMP_IF_NOT_EQUAL: return (SlotUsage){-2, 0};
+    case OP_JUMP_IF_EQUAL: return (SlotUsage){-2, 0};
+    case OP_JUMP_IF_NOT_GREATER: return (SlotUsage){-2, 0};
+    case OP_JUMP_IF_NOT_GREATER_EQUAL: return (SlotUsage){-2, 0};
+    case OP_JUMP_IF_NOT_LESS: return (SlotUsage){-2, 0};
+    case OP_JUMP_IF_NOT_LESS_EQUAL: return (SlotUsage){-2, 0};
   }
   return (SlotUsage){0, 0};
 }
@@ -1,8 +1,10 @@
 #include "table.h"
 
+#include "hash.h"
 #include "memory.h"
 #include "object.h"
 #include "value.h"
+#include "vm.h"
 
 #include <stdlib.h>
 #include <string.h>
@@ -11,8 +13,8 @@
 
 void initTable(Table* table) {
   table->count = 0;
-  table->capacity = 0;
-  table->entries = NULL;
+  PUBLISH(table->capacity, 0);
+  PUBLISH(table->entries, NULL);
 }
 
 void freeTable(Table* table) {
@@ -50,6 +52,27 @@ bool tableGet(Table* table, Value key, Value* value) {
   return true;
 }
 
+bool tableGetString(Table* table, ObjString* key, Value* value) {
+  if (table->count == 0) return false;
+
+  uint32_t index = key->hash & (table->capacity - 1);
+  while (true) {
+    Entry* entry = &table->entries[index];
+    if (IS_EMPTY(entry->key)) {
+      if (IS_NIL(entry->value)) return false;
+    } else {
+      ObjString* string = AS_STRING(entry->key);
+
+      if (string == key) break;
+    }
+
+    index = (index + 1) & (table->capacity - 1);
+  }
+
+  if (value != NULL) *value = table->entries[index].value;
+  return true;
+}
+
 static void adjustCapacity(Table* table, int capacity) {
   Entry* entries = ALLOCATE(Entry, capacity);
   for (int i = 0; i < capacity; i++) {
@@ -69,8 +92,8 @@ static void adjustCapacity(Table* table, int capacity) {
   }
 
   FREE_ARRAY(Entry, table->entries, table->capacity);
-  table->entries = entries;
-  table->capacity = capacity;
+  PUBLISH(table->entries, entries);
+  PUBLISH(table->capacity, capacity);
 }
 
 bool tableSet(Table* table, Value key, Value value) {
@@ -83,8 +106,8 @@ bool tableSet(Table* table, Value key, Value value) {
   bool isNewKey = IS_EMPTY(entry->key);
   if (isNewKey && IS_NIL(entry->value)) table->count++;
 
-  entry->key = key;
-  entry->value = value;
+  PUBLISH(entry->key, key);
+  PUBLISH(entry->value, value);
   return isNewKey;
 }
 
@@ -94,8 +117,8 @@ bool tableDelete(Table* table, Value key) {
   Entry* entry = findEntry(table->entries, table->capacity, key);
   if (IS_EMPTY(entry->key)) return false;
 
-  entry->key = EMPTY_VAL;
-  entry->value = BOOL_VAL(true);
+  PUBLISH(entry->key, EMPTY_VAL);
+  PUBLISH(entry->value, BOOL_VAL(true));
   return true;
 }
 
@@ -119,7 +142,9 @@ tableFindString(Table* table, const char* chars, int length, uint32_t hash) {
       ObjString* string = AS_STRING(entry->key);
 
       if (string->length == length && string->hash == hash &&
-          memcmp(string->chars, chars, length) == 0) {
+          charsEqual(string->chars, chars, length) &&
+          !(vm.gcPhase == GC_SWEEP_STRINGS && string->obj.isOld &&
+            !isMarked(&string->obj))) {
         return string;
       }
     }
@@ -128,19 +153,44 @@ tableFindString(Table* table, const char* chars, int length, uint32_t hash) {
   }
 }
 
-void tableRemoveWhite(Table* table) {
-  for (int i = 0; i < table->capacity; i++) {
+void tableRemoveString(Table* table, ObjString* key) {
+  if (table->count == 0) return;
+
+  uint32_t index = key->hash & (table->capacity - 1);
+  while (true) {
+    Entry* entry = &table->entries[index];
+    if (IS_EMPTY(entry->key)) {
+      if (IS_NIL(entry->value)) return;
+    } else if (IS_OBJ(entry->key) && AS_OBJ(entry->key) == &key->obj) {
+      entry->key = EMPTY_VAL;
+      entry->value = BOOL_VAL(true);
+      return;
+    }
+
+    index = (index + 1) & (table->capacity - 1);
+  }
+}
+
+void tableRemoveWhite(Table* table, int start, int end) {
+  for (int i = start; i < end; i++) {
     Entry* entry = &table->entries[i];
-    if (IS_OBJ(entry->key) && !AS_OBJ(entry->key)->isMarked) {
-      tableDelete(table, entry->key);
+    if (IS_OBJ(entry->key) && AS_OBJ(entry->key)->isOld &&
+        !isMarked(AS_OBJ(entry->key))) {
+      entry->key = EMPTY_VAL;
+      entry->value = BOOL_VAL(true);
     }
   }
 }
 
+// A switch's cases are freed once it gets a dense table, so the entries
+// can be gone by the time the marker reads them.
 void markTable(Table* table) {
-  for (int i = 0; i < table->capacity; i++) {
-    Entry* entry = &table->entries[i];
-    markValue(entry->key);
-    markValue(entry->value);
+  int capacity = CONSUME(table->capacity);
+  Entry* entries = CONSUME(table->entries);
+  if (entries == NULL) return;
+  for (int i = 0; i < capacity; i++) {
+    Entry* entry = &entries[i];
+    markValue(CONSUME(entry->key));
+    markValue(CONSUME(entry->value));
   }
 }
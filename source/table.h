@@ -18,13 +18,15 @@ typedef struct {
 void initTable(Table* table);
 void freeTable(Table* table);
 bool tableGet(Table* table, Value key, Value* value);
+bool tableGetString(Table* table, ObjString* key, Value* value);
 bool tableSet(Table* table, Value key, Value value);
 bool tableDelete(Table* table, Value key);
 void tableAddAll(Table* from, Table* to);
 ObjString*
 tableFindString(Table* table, const char* chars, int length, uint32_t hash);
 
-void tableRemoveWhite(Table* table);
+void tableRemoveString(Table* table, ObjString* key);
+void tableRemoveWhite(Table* table, int start, int end);
 void markTable(Table* table);
 
 #endif
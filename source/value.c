@@ -1,11 +1,14 @@
 #include "value.h"
 
+#include "dtoa.h"
+#include "hash.h"
 #include "memory.h"
 #include "object.h"
 #include "vm.h"
 
 #include <math.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 void initValueArray(ValueArray* array) {
@@ -18,12 +21,13 @@ void writeValueArray(ValueArray* array, Value value) {
   if (array->capacity < array->count + 1) {
     int oldCapacity = array->capacity;
     array->capacity = GROW_CAPACITY(oldCapacity);
-    array->values =
+    Value* values =
         GROW_ARRAY(Value, array->values, oldCapacity, array->capacity);
+    PUBLISH(array->values, values);
   }
 
-  array->values[array->count] = value;
-  array->count++;
+  PUBLISH(array->values[array->count], value);
+  PUBLISH(array->count, array->count + 1);
 }
 
 void freeValueArray(ValueArray* array) {
@@ -31,74 +35,117 @@ void freeValueArray(ValueArray* array) {
   initValueArray(array);
 }
 
-char* valToStr(Value value) {
-  char* buff;
-  int bytes = -1;
+void initWriter(Writer* writer) {
+  writer->capacity = 0;
+  writer->length = 0;
+  writer->chars = NULL;
+}
+
+void freeWriter(Writer* writer) {
+  free(writer->chars);
+  initWriter(writer);
+}
+
+char* reserveChars(Writer* writer, int length) {
+  if (writer->capacity < writer->length + length + 1) {
+    while (writer->capacity < writer->length + length + 1)
+      writer->capacity = GROW_CAPACITY(writer->capacity);
+    writer->chars = (char*)realloc(writer->chars, writer->capacity);
+    if (writer->chars == NULL) exit(1);
+  }
+  return writer->chars + writer->length;
+}
+
+void writeChars(Writer* writer, const char* chars, int length) {
+  memcpy(reserveChars(writer, length), chars, length);
+  writer->length += length;
+}
+
+static void writeNumber(Writer* writer, double number) {
+  writer->length +=
+      numberToStr(reserveChars(writer, NUMBER_TEXT_MAX), number);
+}
 
 #ifdef NAN_BOXING
-  if (IS_BOOL(value)) {
-    bytes = asprintf(&buff, AS_BOOL(value) ? "true" : "false");
-  } else if (IS_NIL(value)) {
-    bytes = asprintf(&buff, "nil");
-  } else if (IS_NUMBER(value)) {
-    double d = AS_NUMBER(value);
+static void writeInt(Writer* writer, int32_t number) {
+  writer->length +=
+      integerToStr(reserveChars(writer, NUMBER_TEXT_MAX), number);
+}
+#endif
 
-    if (fmod(d, 1) == 0 && d != 0)
-      bytes = asprintf(&buff, "%ld", (long)d);
+#define WRITE_LITERAL(writer, text) \
+  writeChars(writer, text, (int)sizeof(text) - 1)
+
+void writeValue(Writer* writer, Value value) {
+#ifdef NAN_BOXING
+  if (IS_BOOL(value)) {
+    if (AS_BOOL(value))
+      WRITE_LITERAL(writer, "true");
     else
-      bytes = asprintf(&buff, "%g", d);
+      WRITE_LITERAL(writer, "false");
+  } else if (IS_NIL(value)) {
+    WRITE_LITERAL(writer, "nil");
+  } else if (IS_INT(value)) {
+    writeInt(writer, AS_INT(value));
+  } else if (IS_DOUBLE(value)) {
+    writeNumber(writer, valueToNum(value));
+  } else if (IS_SMALL_STRING(value)) {
+    smallStringChars(value, reserveChars(writer, sizeof(Value)));
+    writer->length += SMALL_STRING_LENGTH(value);
   } else if (IS_OBJ(value)) {
-    bytes = objToStr(&buff, value);
+    writeObject(writer, value);
   } else if (IS_EMPTY(value)) {
-    bytes = asprintf(&buff, "<empty>");
+    WRITE_LITERAL(writer, "<empty>");
   } else if (IS_UNDEFINED(value)) {
-    bytes = asprintf(&buff, "<undefined>");
+    WRITE_LITERAL(writer, "<undefined>");
   }
 #else
   switch (value.type) {
     case VAL_BOOL:
-      bytes = asprintf(&buff, AS_BOOL(value) ? "true" : "false");
-      break;
-    case VAL_NIL: bytes = asprintf(&buff, "nil"); break;
-    case VAL_NUMBER: {
-      double d = AS_NUMBER(value);
-
-      if (fmod(d, 1) == 0 && d != 0)
-        bytes = asprintf(&buff, "%ld", (long)d);
+      if (AS_BOOL(value))
+        WRITE_LITERAL(writer, "true");
       else
-        bytes = asprintf(&buff, "%g", d);
+        WRITE_LITERAL(writer, "false");
       break;
-    }
-    case VAL_OBJ: bytes = objToStr(&buff, value); break;
-    case VAL_EMPTY: bytes = asprintf(&buff, "<empty>"); break;
-    case VAL_UNDEFINED: bytes = asprintf(&buff, "<undefined>"); break;
+    case VAL_NIL: WRITE_LITERAL(writer, "nil"); break;
+    case VAL_NUMBER: writeNumber(writer, AS_NUMBER(value)); break;
+    case VAL_OBJ: writeObject(writer, value); break;
+    case VAL_EMPTY: WRITE_LITERAL(writer, "<empty>"); break;
+    case VAL_UNDEFINED: WRITE_LITERAL(writer, "<undefined>"); break;
   }
 #endif
-  if (bytes == -1) return NULL;
-  vm.bytesAllocated += bytes;
-  return buff;
+}
+
+#undef WRITE_LITERAL
+
+char* valToStr(Value value) {
+  Writer writer;
+  initWriter(&writer);
+  writeValue(&writer, value);
+  reserveChars(&writer, 0)[0] = '\0';
+  vm.bytesAllocated += writer.length + 1;
+  return writer.chars;
 }
 
 void printValue(Value value) {
-  char* str = valToStr(value);
+  Writer writer;
+  initWriter(&writer);
+  writeValue(&writer, value);
+  fwrite(writer.chars, 1, writer.length, stdout);
+  freeWriter(&writer);
+}
 
-  if (str != NULL) {
-    printf("%s", str);
-    FREE_ARRAY(char, str, strlen(str) + 1);
-  }
+Value numberValue(double number) {
+  if (isInt32(number) && (number != 0 || !signbit(number)))
+    return INT_VAL((int32_t)number);
+  return NUMBER_VAL(number);
 }
 
 bool valuesEqual(Value a, Value b) {
 #ifdef NAN_BOXING
-  if (IS_NUMBER(a) && IS_NUMBER(b)) return AS_NUMBER(a) == AS_NUMBER(b);
-  if (a == b) return true;
-  if (IS_STRING(a) && IS_STRING(b)) {
-    ObjString* strA = AS_STRING(a);
-    ObjString* strB = AS_STRING(b);
-    return strA->length == strB->length && strA->hash == strB->hash &&
-           memcmp(strA->chars, strB->chars, strA->length) == 0;
-  }
-  return false;
+  if (a == b) return !IS_DOUBLE(a) || valueToNum(a) == valueToNum(a);
+  if (!IS_DOUBLE(a) && !IS_DOUBLE(b)) return false;
+  return IS_NUMBER(a) && IS_NUMBER(b) && AS_NUMBER(a) == AS_NUMBER(b);
 #else
   if (a.type != b.type) return false;
   switch (a.type) {
@@ -106,41 +153,45 @@ bool valuesEqual(Value a, Value b) {
     case VAL_EMPTY:
     case VAL_NIL: return true;
     case VAL_NUMBER: return AS_NUMBER(a) == AS_NUMBER(b);
-    case VAL_OBJ: {
-      if (AS_OBJ(a) == AS_OBJ(b)) return true;
-      if (IS_STRING(a) && IS_STRING(b)) {
-        ObjString* strA = AS_STRING(a);
-        ObjString* strB = AS_STRING(b);
-        return strA->length == strB->length && strA->hash == strB->hash &&
-               memcmp(strA->chars, strB->chars, strA->length) == 0;
-      }
-      return false;
-    }
+    case VAL_OBJ: return AS_OBJ(a) == AS_OBJ(b);
     default: return false;
   }
 #endif
 }
 
-static uint32_t hashDouble(double value) {
-  union BitCast {
-    double value;
-    uint32_t ints[2];
-  };
+static uint32_t hashBits(uint64_t bits) {
+  bits ^= bits >> 33;
+  bits *= 0xFF51AFD7ED558CCDull;
+  bits ^= bits >> 33;
+  bits *= 0xC4CEB9FE1A85EC53ull;
+  bits ^= bits >> 33;
+  return (uint32_t)bits;
+}
 
-  union BitCast cast;
-  cast.value = (value) + 1.0;
+static uint32_t hashInt(int32_t value) {
+  return hashBits((uint64_t)(uint32_t)value + 1);
+}
 
-  uint32_t hash = cast.ints[0] + cast.ints[1];
+static uint32_t hashDouble(double value) {
+  if (isInt32(value)) return hashInt((int32_t)value);
 
-  return hashString((char*)&hash, 4);
+  uint64_t bits;
+  memcpy(&bits, &value, sizeof(double));
+  return hashBits(bits);
 }
 
 uint32_t hashValue(Value value) {
 #ifdef NAN_BOXING
   if (IS_BOOL(value)) return AS_BOOL(value) ? 3 : 5;
   if (IS_NIL(value)) return 7;
-  if (IS_NUMBER(value)) return hashDouble(AS_NUMBER(value));
+  if (IS_INT(value)) return hashInt(AS_INT(value));
+  if (IS_DOUBLE(value)) return hashDouble(valueToNum(value));
   if (IS_STRING(value)) return AS_STRING(value)->hash;
+  if (IS_SMALL_STRING(value)) {
+    char chars[sizeof(Value)];
+    smallStringChars(value, chars);
+    return hashString(chars, SMALL_STRING_LENGTH(value));
+  }
 #else
   switch (value.type) {
     case VAL_BOOL: return AS_BOOL(value) ? 3 : 5;
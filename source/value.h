@@ -19,23 +19,36 @@ typedef struct ObjString ObjString;
 #define TAG_TRUE 3
 #define TAG_UNDEFINED 4
 
+#define SMALL_STRING_BIT ((uint64_t)0x0001000000000000)
+#define SMALL_STRING_MAX 5
+
+#define INT_BIT ((uint64_t)0x0002000000000000)
+
 typedef uint64_t Value;
 
 #define IS_BOOL(value) (((value) | 1) == TRUE_VAL)
 #define IS_NIL(value) ((value) == NIL_VAL)
-#define IS_NUMBER(value) (((value) & QNAN) != QNAN)
+#define IS_DOUBLE(value) (((value) & QNAN) != QNAN)
+#define IS_INT(value) (((value) >> 48) == (QNAN | INT_BIT) >> 48)
+#define IS_NUMBER(value) (IS_DOUBLE(value) | IS_INT(value))
+#define BOTH_INTS(a, b) (IS_INT(a) & IS_INT(b))
 #define IS_OBJ(value) (((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
 #define IS_EMPTY(value) ((value) == EMPTY_VAL)
 #define IS_UNDEFINED(value) ((value) == UNDEFINED_VAL)
+#define IS_SMALL_STRING(value) \
+  (((value) & (SIGN_BIT | QNAN | SMALL_STRING_BIT)) == \
+   (QNAN | SMALL_STRING_BIT))
 
 #define AS_BOOL(value) ((value) == TRUE_VAL)
-#define AS_NUMBER(value) valueToNum(value)
+#define AS_INT(value) ((int32_t)(uint32_t)(value))
+#define AS_NUMBER(value) asNumber(value)
 #define AS_OBJ(value) ((Obj*)(uintptr_t)((value) & ~(SIGN_BIT | QNAN)))
 
 #define BOOL_VAL(b) ((b) ? TRUE_VAL : FALSE_VAL)
 #define FALSE_VAL ((Value)(uint64_t)(QNAN | TAG_FALSE))
 #define TRUE_VAL ((Value)(uint64_t)(QNAN | TAG_TRUE))
 #define NIL_VAL ((Value)(uint64_t)(QNAN | TAG_NIL))
+#define INT_VAL(i) ((Value)(QNAN | INT_BIT | (uint32_t)(int32_t)(i)))
 #define NUMBER_VAL(num) numToValue(num)
 #define OBJ_VAL(obj) (Value)(SIGN_BIT | QNAN | (uint64_t)(uintptr_t)(obj))
 #define EMPTY_VAL ((Value)(uint64_t)(QNAN | TAG_EMPTY))
@@ -53,6 +66,24 @@ static inline Value numToValue(double num) {
   return value;
 }
 
+static inline double asNumber(Value value) {
+  return IS_INT(value) ? (double)AS_INT(value) : valueToNum(value);
+}
+
+#define SMALL_STRING_LENGTH(value) ((int)((value) >> 40) & 0x7)
+
+static inline Value smallString(const char* chars, int length) {
+  Value value = QNAN | SMALL_STRING_BIT | (uint64_t)length << 40;
+  for (int i = 0; i < length; i++)
+    value |= (uint64_t)(uint8_t)chars[i] << (i * 8);
+  return value;
+}
+
+static inline void smallStringChars(Value value, char* chars) {
+  for (int i = 0; i < SMALL_STRING_LENGTH(value); i++)
+    chars[i] = (char)(value >> (i * 8));
+}
+
 #else
 
 typedef enum {
@@ -80,18 +111,27 @@ typedef struct {
 #define IS_OBJ(value) ((value).type == VAL_OBJ)
 #define IS_EMPTY(value) ((value).type == VAL_EMPTY)
 #define IS_UNDEFINED(value) ((value).type == VAL_UNDEFINED)
+#define IS_SMALL_STRING(value) false
+#define IS_INT(value) false
+#define BOTH_INTS(a, b) false
+#define IS_DOUBLE(value) IS_NUMBER(value)
 
 #define AS_OBJ(value) ((value).as.obj)
 #define AS_BOOL(value) ((value).as.boolean)
 #define AS_NUMBER(value) ((value).as.number)
+#define AS_INT(value) ((int32_t)AS_NUMBER(value))
 
 #define BOOL_VAL(value) ((Value){VAL_BOOL, {.boolean = value}})
 #define NIL_VAL ((Value){VAL_NIL, {.number = 0}})
 #define NUMBER_VAL(value) ((Value){VAL_NUMBER, {.number = value}})
+#define INT_VAL(value) NUMBER_VAL(value)
 #define OBJ_VAL(object) ((Value){VAL_OBJ, {.obj = (Obj*)object}})
 #define EMPTY_VAL ((Value){VAL_EMPTY, {.number = 0}})
 #define UNDEFINED_VAL ((Value){VAL_UNDEFINED, {.number = 0}})
 
+#define SMALL_STRING_MAX -1
+#define SMALL_STRING_LENGTH(value) 0
+
 #endif
 
 typedef struct {
@@ -100,10 +140,27 @@ typedef struct {
   Value* values;
 } ValueArray;
 
+typedef struct {
+  int capacity;
+  int length;
+  char* chars;
+} Writer;
+
+static inline bool isInt32(double number) {
+  return number >= INT32_MIN && number <= INT32_MAX &&
+         (double)(int32_t)number == number;
+}
+
+Value numberValue(double number);
 bool valuesEqual(Value a, Value b);
 void initValueArray(ValueArray* array);
 void writeValueArray(ValueArray* array, Value value);
 void freeValueArray(ValueArray* array);
+void initWriter(Writer* writer);
+void freeWriter(Writer* writer);
+char* reserveChars(Writer* writer, int length);
+void writeChars(Writer* writer, const char* chars, int length);
+void writeValue(Writer* writer, Value value);
 char* valToStr(Value value);
 void printValue(Value value);
 uint32_t hashValue(Value value);
@@ -12,8 +12,18 @@
 #include <stdlib.h>
 #include <string.h>
 
+#define ROPE_MIN_LENGTH 64
+
 VM vm;
 
+#ifdef DEBUG_LOG_CACHE
+#define COUNT_HIT(cache) ((cache)->hits++)
+#define COUNT_MISS(cache) ((cache)->misses++)
+#else
+#define COUNT_HIT(cache) ((void)0)
+#define COUNT_MISS(cache) ((void)0)
+#endif
+
 static void resetStack() {
   vm.stackTop = vm.stack;
   vm.frameCount = 0;
@@ -45,7 +55,7 @@ static void runtimeError(const char* format, ...) {
 char* getGlobalName(uint16_t index) {
   for (int i = 0; i < vm.globalNames.capacity; i++) {
     Entry* entry = &vm.globalNames.entries[i];
-    if ((uint16_t)AS_NUMBER(entry->value) == index)
+    if ((uint16_t)AS_INT(entry->value) == index)
       return AS_STRING(entry->key)->chars;
   }
   return NULL;
@@ -56,7 +66,7 @@ static void defineNative(const char* name, NativeFn function) {
   push(OBJ_VAL(newNative(function)));
   uint16_t index = (uint16_t)vm.globalValues.count;
   writeValueArray(&vm.globalValues, vm.stack[1]);
-  tableSet(&vm.globalNames, vm.stack[0], NUMBER_VAL(index));
+  tableSet(&vm.globalNames, vm.stack[0], INT_VAL(index));
   pop();
   pop();
 }
@@ -84,7 +94,6 @@ void initVM() {
   vm.stack = NULL;
   vm.stackCapacity = 0;
   resetStack();
-  slotsNeeded(2);
   vm.objects = NULL;
   vm.bytesAllocated = 0;
   vm.nextGC = 1024 * 1024;
@@ -92,10 +101,35 @@ void initVM() {
   vm.grayCount = 0;
   vm.grayCapacity = 0;
   vm.grayStack = NULL;
+  vm.gcPhase = GC_IDLE;
+  vm.markEpoch = 1;
+  vm.nextStep = 0;
+  vm.sweepList = NULL;
+  vm.sweepPage = NULL;
+  vm.stringCursor = 0;
+  vm.stringCapacity = 0;
+  vm.maxPause = 0;
+
+  vm.youngBytes = 0;
+  vm.youngObjects = NULL;
+  vm.pages = NULL;
+  for (int i = 0; i < SIZE_CLASSES; i++) vm.availablePages[i] = NULL;
+  vm.youngPages = NULL;
+  vm.freePages = NULL;
+  vm.freePageCount = 0;
+  vm.collectingYoung = false;
+  vm.rememberedCount = 0;
+  vm.rememberedCapacity = 0;
+  vm.remembered = NULL;
+
+  // The stack is the first allocation, so the collector's state must be
+  // set up before it.
+  slotsNeeded(2);
 
   initTable(&vm.globalNames);
   initValueArray(&vm.globalValues);
   initTable(&vm.strings);
+  initWriter(&vm.writer);
 
   vm.initString = NULL;
   vm.initString = copyString("init", 4);
@@ -114,6 +148,7 @@ void freeVM() {
   freeTable(&vm.globalNames);
   freeValueArray(&vm.globalValues);
   freeTable(&vm.strings);
+  freeWriter(&vm.writer);
   vm.initString = NULL;
   freeObjects();
 }
@@ -148,6 +183,12 @@ static inline Value peek1() {
   return vm.stackTop[-2];
 }
 
+static void flattenStack(int count) {
+  for (Value* slot = vm.stackTop - count; slot < vm.stackTop; slot++) {
+    if (IS_ROPE(*slot)) *slot = OBJ_VAL(flattenRope(AS_ROPE(*slot)));
+  }
+}
+
 static bool call(ObjClosure* closure, int argCount) {
   if (argCount != closure->function->arity) {
     runtimeError(
@@ -191,6 +232,7 @@ static bool callValue(Value callee, int argCount) {
       case OBJ_CLOSURE: return call(AS_CLOSURE(callee), argCount);
       case OBJ_NATIVE: {
         NativeFn native = AS_NATIVE(callee);
+        flattenStack(argCount);
         bool success = native(argCount, vm.stackTop - argCount);
         vm.stackTop -= argCount;
         if (!success) runtimeError(AS_CSTRING(peek0()));
@@ -203,25 +245,46 @@ static bool callValue(Value callee, int argCount) {
   return false;
 }
 
-static bool invokeFromClass(
-    ObjClass* klass, ObjString* name, int argCount, Callsite* callsite) {
-  if (callsite->klass == klass) {
-    return call(callsite->method, argCount);
-  } else {
-    Value methodVal;
+static void rememberCaches() {
+  rememberObject((Obj*)vm.frames[vm.frameCount - 1].closure->function);
+}
 
-    if (!tableGet(&klass->methods, OBJ_VAL(name), &methodVal)) {
-      runtimeError("Undefined property '%s'.", name->chars);
-      return false;
-    }
+static ObjClosure* cachedMethod(Callsite* callsite, Obj* key) {
+  for (int i = 0; i < callsite->count; i++) {
+    CallsiteEntry* entry = &callsite->entries[i];
+    if (entry->key == key) return entry->method;
+  }
+  return NULL;
+}
 
-    ObjClosure* method = AS_CLOSURE(methodVal);
+static void cacheMethod(Callsite* callsite, Obj* key, ObjClosure* method) {
+  if (callsite->megamorphic) return;
 
-    callsite->klass = klass;
-    callsite->method = method;
+  if (callsite->count == CALLSITE_ENTRIES) {
+    PUBLISH(callsite->count, 0);
+    callsite->megamorphic = true;
+    return;
+  }
 
-    return call(method, argCount);
+  CallsiteEntry* entry = &callsite->entries[callsite->count];
+  PUBLISH(entry->key, key);
+  PUBLISH(entry->method, method);
+  PUBLISH(callsite->count, callsite->count + 1);
+  rememberCaches();
+}
+
+static bool invokeFromClass(
+    ObjClass* klass, ObjString* name, int argCount, Callsite* callsite,
+    Obj* key) {
+  Value method;
+
+  if (!tableGet(&klass->methods, OBJ_VAL(name), &method)) {
+    runtimeError("Undefined property '%s'.", name->chars);
+    return false;
   }
+
+  if (key != NULL) cacheMethod(callsite, key, AS_CLOSURE(method));
+  return call(AS_CLOSURE(method), argCount);
 }
 
 static bool invoke(ObjString* name, int argCount, Callsite* callsite) {
@@ -233,14 +296,37 @@ static bool invoke(ObjString* name, int argCount, Callsite* callsite) {
   }
 
   ObjInstance* instance = AS_INSTANCE(receiver);
+  Obj* shape = (Obj*)instance->shape;
+
+  if (shape != NULL) {
+    ObjClosure* method = cachedMethod(callsite, shape);
+    if (method != NULL) {
+      COUNT_HIT(callsite);
+      return call(method, argCount);
+    }
+  }
+  COUNT_MISS(callsite);
 
   Value value;
-  if (tableGet(&instance->fields, OBJ_VAL(name), &value)) {
+  if (instanceGet(instance, OBJ_VAL(name), &value)) {
     vm.stackTop[-argCount - 1] = value;
     return callValue(value, argCount);
   }
 
-  return invokeFromClass(instance->klass, name, argCount, callsite);
+  return invokeFromClass(instance->klass, name, argCount, callsite, shape);
+}
+
+static bool superInvoke(
+    ObjClass* superclass, ObjString* name, int argCount, Callsite* callsite) {
+  ObjClosure* method = cachedMethod(callsite, (Obj*)superclass);
+  if (method != NULL) {
+    COUNT_HIT(callsite);
+    return call(method, argCount);
+  }
+  COUNT_MISS(callsite);
+
+  return invokeFromClass(
+      superclass, name, argCount, callsite, (Obj*)superclass);
 }
 
 static bool bindMethod(ObjClass* klass, ObjString* name) {
@@ -254,6 +340,49 @@ static bool bindMethod(ObjClass* klass, ObjString* name) {
   return true;
 }
 
+static bool getProperty(
+    ObjInstance* instance, ObjString* name, PropertyCache* cache) {
+  Value value;
+
+  if (instance->shape == NULL) {
+    if (tableGet(instance->fields, OBJ_VAL(name), &value)) {
+      put(value);
+      return true;
+    }
+    return bindMethod(instance->klass, name);
+  }
+
+  int slot = findSlot(instance->shape, OBJ_VAL(name));
+  if (slot != -1) {
+    PUBLISH(cache->shape, instance->shape);
+    PUBLISH(cache->method, NULL);
+    cache->slot = slot;
+    rememberCaches();
+    put(instance->slots[slot]);
+    return true;
+  }
+
+  if (!bindMethod(instance->klass, name)) return false;
+
+  PUBLISH(cache->shape, instance->shape);
+  PUBLISH(cache->method, AS_BOUND_METHOD(peek0())->method);
+  cache->slot = -1;
+  rememberCaches();
+  return true;
+}
+
+static void setProperty(
+    ObjInstance* instance, Value name, Value value, PropertyCache* cache) {
+  ObjShape* shape = instance->shape;
+  instanceSet(instance, name, value);
+  if (shape == NULL || instance->shape == NULL) return;
+
+  PUBLISH(cache->shape, shape);
+  PUBLISH(cache->transition, instance->shape != shape ? instance->shape : NULL);
+  cache->slot = findSlot(instance->shape, name);
+  rememberCaches();
+}
+
 static ObjUpvalue* captureUpvalue(Value* local) {
   ObjUpvalue* prevUpvalue = NULL;
   ObjUpvalue* upvalue = vm.openUpvalues;
@@ -279,8 +408,9 @@ static ObjUpvalue* captureUpvalue(Value* local) {
 static void closeUpvalues(Value* last) {
   while (vm.openUpvalues != NULL && vm.openUpvalues->location >= last) {
     ObjUpvalue* upvalue = vm.openUpvalues;
-    upvalue->closed = *upvalue->location;
+    PUBLISH(upvalue->closed, *upvalue->location);
     upvalue->location = &upvalue->closed;
+    writeBarrier(&upvalue->obj, upvalue->closed);
     vm.openUpvalues = upvalue->next;
   }
 }
@@ -290,32 +420,142 @@ static void defineMethod(ObjString* name) {
   ObjClass* klass = AS_CLASS(peek1());
   tableSet(&klass->methods, OBJ_VAL(name), method);
   if (name == vm.initString) klass->initializer = method;
+  writeBarrier(&klass->obj, OBJ_VAL(name));
+  writeBarrier(&klass->obj, method);
   pop();
 }
 
+static inline Value addInts(int32_t a, int32_t b) {
+  int32_t sum;
+  if (__builtin_add_overflow(a, b, &sum)) return NUMBER_VAL((double)a + b);
+  return INT_VAL(sum);
+}
+
+static inline Value subtractInts(int32_t a, int32_t b) {
+  int32_t difference;
+  if (__builtin_sub_overflow(a, b, &difference))
+    return NUMBER_VAL((double)a - b);
+  return INT_VAL(difference);
+}
+
 static bool isFalsey(Value value) {
   return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
 }
 
+static bool operandsEqual() {
+  if (valuesEqual(peek1(), peek0())) return true;
+  if (!IS_ROPE(peek0()) && !IS_ROPE(peek1())) return false;
+
+  flattenStack(2);
+  return valuesEqual(peek1(), peek0());
+}
+
+static int switchOffset(SwitchTable* table) {
+  Value value = peek0();
+  if (table->offsets != NULL) {
+    int64_t index;
+    if (IS_INT(value))
+      index = AS_INT(value);
+    else if (IS_NUMBER(value) && isInt32(AS_NUMBER(value)))
+      index = (int32_t)AS_NUMBER(value);
+    else
+      return table->miss;
+
+    index -= table->low;
+    if (index < 0 || index >= table->length || table->offsets[index] == -1)
+      return table->miss;
+    return table->offsets[index];
+  }
+
+  if (IS_ROPE(value)) {
+    flattenStack(1);
+    value = peek0();
+  }
+  Value offset;
+  return tableGet(&table->cases, value, &offset) ? AS_INT(offset)
+                                                 : table->miss;
+}
+
 static void concatenate() {
-  ObjString* b = AS_STRING(peek0());
-  ObjString* a = AS_STRING(peek1());
-
-  int length = a->length + b->length;
-  ObjString* result = allocateString(length);
-  memcpy(result->chars, a->chars, a->length);
-  memcpy(result->chars + a->length, b->chars, b->length);
-  result->chars[length] = '\0';
-  result->hash = hashString(result->chars, length);
-
-  push(OBJ_VAL(result));
-  tableSet(&vm.strings, OBJ_VAL(result), NIL_VAL);
-  pop();
+  Value b = peek0();
+  Value a = peek1();
+  int length = stringLength(a) + stringLength(b);
+  if (length >= ROPE_MIN_LENGTH) {
+    ObjRope* rope = newRope(a, b, length);
+    pop();
+    put(OBJ_VAL(rope));
+    return;
+  }
+
+  Value result;
+  if (length <= SMALL_STRING_MAX) {
+    char chars[sizeof(Value)];
+    copyChars(a, chars);
+    copyChars(b, chars + stringLength(a));
+    result = stringValue(chars, length);
+  } else {
+    ObjString* string = allocateString(length);
+    copyChars(a, string->chars);
+    copyChars(b, string->chars + stringLength(a));
+    result = OBJ_VAL(internString(string));
+  }
 
   pop();
-  put(OBJ_VAL(result));
+  put(result);
+}
+
+static void buildString(int count) {
+  Value* parts = vm.stackTop - count;
+  int starts[UINT8_MAX];
+  int lengths[UINT8_MAX];
+
+  vm.writer.length = 0;
+  int length = 0;
+  for (int i = 0; i < count; i++) {
+    if (isString(parts[i])) {
+      lengths[i] = stringLength(parts[i]);
+    } else {
+      starts[i] = vm.writer.length;
+      writeValue(&vm.writer, parts[i]);
+      lengths[i] = vm.writer.length - starts[i];
+    }
+    length += lengths[i];
+  }
+
+  char small[sizeof(Value)];
+  ObjString* string =
+      length > SMALL_STRING_MAX ? allocateString(length) : NULL;
+  char* end = string != NULL ? string->chars : small;
+  for (int i = 0; i < count; i++) {
+    if (isString(parts[i])) {
+      copyChars(parts[i], end);
+    } else {
+      memcpy(end, vm.writer.chars + starts[i], lengths[i]);
+    }
+    end += lengths[i];
+  }
+
+  Value result = string != NULL ? OBJ_VAL(internString(string))
+                                : stringValue(small, length);
+  vm.stackTop -= count;
+  push(result);
 }
 
+#ifdef DEBUG_TRACE_EXECUTION
+static void traceExecution(CallFrame* frame, uint8_t* ip) {
+  printf("          ");
+  for (Value* slot = vm.stack; slot < vm.stackTop; slot++) {
+    printf("[ ");
+    printValue(*slot);
+    printf(" ]");
+  }
+  printf("\n");
+  disassembleInstr(
+      &frame->closure->function->chunk,
+      (int)(ip - frame->closure->function->chunk.code));
+}
+#endif
+
 static InterpretResult run() {
   CallFrame* frame = &vm.frames[vm.frameCount - 1];
   register uint8_t* ip = frame->ip;
@@ -326,7 +566,15 @@ static InterpretResult run() {
   (frame->closure->function->chunk.constants.values[READ_SHORT()])
 #define READ_CALLSITE() \
   (&frame->closure->function->chunk.callsites[READ_SHORT()])
+#define READ_CACHE() (&frame->closure->function->chunk.caches[READ_SHORT()])
 #define READ_STRING() AS_STRING(READ_CONSTANT())
+#ifdef DEBUG_TRACE_EXECUTION
+#define TRACE_EXECUTION() traceExecution(frame, ip)
+#else
+#define TRACE_EXECUTION() \
+  do { \
+  } while (false)
+#endif
 #define BINARY_OP(valueType, op) \
   do { \
     if (!IS_NUMBER(peek0()) || !IS_NUMBER(peek1())) { \
@@ -337,31 +585,130 @@ static InterpretResult run() {
     double b = AS_NUMBER(pop()); \
     put(valueType(AS_NUMBER(peek0()) op b)); \
   } while (false)
+#define COMPARE_OP(op) \
+  do { \
+    if (BOTH_INTS(peek0(), peek1())) { \
+      int32_t b = AS_INT(pop()); \
+      put(BOOL_VAL(AS_INT(peek0()) op b)); \
+    } else { \
+      BINARY_OP(BOOL_VAL, op); \
+    } \
+  } while (false)
+#define COMPARE_JUMP(op) \
+  do { \
+    uint16_t offset = READ_SHORT(); \
+    bool result; \
+    if (BOTH_INTS(peek0(), peek1())) { \
+      result = AS_INT(peek1()) op AS_INT(peek0()); \
+    } else if (IS_NUMBER(peek0()) && IS_NUMBER(peek1())) { \
+      result = AS_NUMBER(peek1()) op AS_NUMBER(peek0()); \
+    } else { \
+      frame->ip = ip; \
+      runtimeError("Operands must be numbers."); \
+      return INTERPRET_RUNTIME_ERROR; \
+    } \
+    vm.stackTop -= 2; \
+    if (!result) ip += offset; \
+  } while (false)
+#define QUICKEN(op) (ip[-1] = op)
+#define UNQUICKEN(op) (ip[-1] = op, ip--)
+
+#ifdef COMPUTED_GOTO
+  static void* dispatchTable[] = {
+      [OP_CONSTANT] = &&label_OP_CONSTANT,
+      [OP_NIL] = &&label_OP_NIL,
+      [OP_TRUE] = &&label_OP_TRUE,
+      [OP_FALSE] = &&label_OP_FALSE,
+      [OP_POP] = &&label_OP_POP,
+      [OP_GET_LOCAL] = &&label_OP_GET_LOCAL,
+      [OP_SET_LOCAL] = &&label_OP_SET_LOCAL,
+      [OP_GET_GLOBAL] = &&label_OP_GET_GLOBAL,
+      [OP_DEFINE_GLOBAL] = &&label_OP_DEFINE_GLOBAL,
+      [OP_SET_GLOBAL] = &&label_OP_SET_GLOBAL,
+      [OP_GET_UPVALUE] = &&label_OP_GET_UPVALUE,
+      [OP_SET_UPVALUE] = &&label_OP_SET_UPVALUE,
+      [OP_GET_PROPERTY] = &&label_OP_GET_PROPERTY,
+      [OP_SET_PROPERTY] = &&label_OP_SET_PROPERTY,
+      [OP_GET_SUPER] = &&label_OP_GET_SUPER,
+      [OP_EQUAL] = &&label_OP_EQUAL,
+      [OP_GREATER] = &&label_OP_GREATER,
+      [OP_LESS] = &&label_OP_LESS,
+      [OP_ADD] = &&label_OP_ADD,
+      [OP_SUBTRACT] = &&label_OP_SUBTRACT,
+      [OP_MULTIPLY] = &&label_OP_MULTIPLY,
+      [OP_DIVIDE] = &&label_OP_DIVIDE,
+      [OP_NOT] = &&label_OP_NOT,
+      [OP_NEGATE] = &&label_OP_NEGATE,
+      [OP_PRINT] = &&label_OP_PRINT,
+      [OP_JUMP] = &&label_OP_JUMP,
+      [OP_JUMP_IF_FALSE] = &&label_OP_JUMP_IF_FALSE,
+      [OP_LOOP] = &&label_OP_LOOP,
+      [OP_CALL] = &&label_OP_CALL,
+      [OP_INVOKE] = &&label_OP_INVOKE,
+      [OP_SUPER_INVOKE] = &&label_OP_SUPER_INVOKE,
+      [OP_CLOSURE] = &&label_OP_CLOSURE,
+      [OP_CLOSE_UPVALUE] = &&label_OP_CLOSE_UPVALUE,
+      [OP_RETURN] = &&label_OP_RETURN,
+      [OP_CLASS] = &&label_OP_CLASS,
+      [OP_INHERIT] = &&label_OP_INHERIT,
+      [OP_METHOD] = &&label_OP_METHOD,
+      [OP_CONSTANT_NEGATIVE_ONE] = &&label_OP_CONSTANT_NEGATIVE_ONE,
+      [OP_CONSTANT_ZERO] = &&label_OP_CONSTANT_ZERO,
+      [OP_CONSTANT_ONE] = &&label_OP_CONSTANT_ONE,
+      [OP_CONSTANT_TWO] = &&label_OP_CONSTANT_TWO,
+      [OP_CONSTANT_THREE] = &&label_OP_CONSTANT_THREE,
+      [OP_CONSTANT_FOUR] = &&label_OP_CONSTANT_FOUR,
+      [OP_CONSTANT_FIVE] = &&label_OP_CONSTANT_FIVE,
+      [OP_ADD_ONE] = &&label_OP_ADD_ONE,
+      [OP_SUBTRACT_ONE] = &&label_OP_SUBTRACT_ONE,
+      [OP_MULTIPLY_TWO] = &&label_OP_MULTIPLY_TWO,
+      [OP_EQUAL_ZERO] = &&label_OP_EQUAL_ZERO,
+      [OP_NOT_EQUAL] = &&label_OP_NOT_EQUAL,
+      [OP_GREATER_EQUAL] = &&label_OP_GREATER_EQUAL,
+      [OP_LESS_EQUAL] = &&label_OP_LESS_EQUAL,
+      [OP_GET_THIS] = &&label_OP_GET_THIS,
+      [OP_DUP] = &&label_OP_DUP,
+      [OP_ADD_NUM] = &&label_OP_ADD_NUM,
+      [OP_ADD_STR] = &&label_OP_ADD_STR,
+      [OP_EQUAL_NUM] = &&label_OP_EQUAL_NUM,
+      [OP_NOT_EQUAL_NUM] = &&label_OP_NOT_EQUAL_NUM,
+      [OP_BUILD_STRING] = &&label_OP_BUILD_STRING,
+      [OP_SWITCH] = &&label_OP_SWITCH,
+      [OP_POP_JUMP_IF_FALSE] = &&label_OP_POP_JUMP_IF_FALSE,
+      [OP_JUMP_IF_NOT_EQUAL] = &&label_OP_JUMP_IF_NOT_EQUAL,
+      [OP_JUMP_IF_EQUAL] = &&label_OP_JUMP_IF_EQUAL,
+      [OP_JUMP_IF_NOT_GREATER] = &&label_OP_JUMP_IF_NOT_GREATER,
+      [OP_JUMP_IF_NOT_GREATER_EQUAL] = &&label_OP_JUMP_IF_NOT_GREATER_EQUAL,
+      [OP_JUMP_IF_NOT_LESS] = &&label_OP_JUMP_IF_NOT_LESS,
+      [OP_JUMP_IF_NOT_LESS_EQUAL] = &&label_OP_JUMP_IF_NOT_LESS_EQUAL,
+  };
+
+#define CASE(op) \
+  case op: \
+  label_##op
+#define DISPATCH() \
+  do { \
+    TRACE_EXECUTION(); \
+    goto *dispatchTable[READ_BYTE()]; \
+  } while (false)
+#else
+#define CASE(op) case op
+#define DISPATCH() break
+#endif
 
   while (true) {
-#ifdef DEBUG_TRACE_EXECUTION
-    printf("          ");
-    for (Value* slot = vm.stack; slot < vm.stackTop; slot++) {
-      printf("[ ");
-      printValue(*slot);
-      printf(" ]");
-    }
-    printf("\n");
-    disassembleInstr(
-        &frame->closure->function->chunk,
-        (int)(ip - frame->closure->function->chunk.code));
-#endif
+    TRACE_EXECUTION();
 
     OpCode instruction = READ_BYTE();
     switch (instruction) {
-      case OP_CONSTANT: push(READ_CONSTANT()); break;
-      case OP_NIL: push(NIL_VAL); break;
-      case OP_TRUE: push(BOOL_VAL(true)); break;
-      case OP_FALSE: push(BOOL_VAL(false)); break;
-      case OP_POP: pop(); break;
-      case OP_GET_LOCAL: push(frame->slots[READ_BYTE()]); break;
-      case OP_SET_LOCAL: frame->slots[READ_BYTE()] = peek0(); break;
-      case OP_GET_GLOBAL: {
+      CASE(OP_CONSTANT): push(READ_CONSTANT()); DISPATCH();
+      CASE(OP_NIL): push(NIL_VAL); DISPATCH();
+      CASE(OP_TRUE): push(BOOL_VAL(true)); DISPATCH();
+      CASE(OP_FALSE): push(BOOL_VAL(false)); DISPATCH();
+      CASE(OP_POP): pop(); DISPATCH();
+      CASE(OP_GET_LOCAL): push(frame->slots[READ_BYTE()]); DISPATCH();
+      CASE(OP_SET_LOCAL): frame->slots[READ_BYTE()] = peek0(); DISPATCH();
+      CASE(OP_GET_GLOBAL): {
         uint16_t index = READ_SHORT();
         Value value = vm.globalValues.values[index];
         if (IS_UNDEFINED(value)) {
@@ -370,12 +717,12 @@ static InterpretResult run() {
           return INTERPRET_RUNTIME_ERROR;
         }
         push(value);
-        break;
+        DISPATCH();
       }
-      case OP_DEFINE_GLOBAL:
+      CASE(OP_DEFINE_GLOBAL):
         vm.globalValues.values[READ_SHORT()] = pop();
-        break;
-      case OP_SET_GLOBAL: {
+        DISPATCH();
+      CASE(OP_SET_GLOBAL): {
         uint16_t index = READ_SHORT();
         if (IS_UNDEFINED(vm.globalValues.values[index])) {
           frame->ip = ip;
@@ -383,15 +730,18 @@ static InterpretResult run() {
           return INTERPRET_RUNTIME_ERROR;
         }
         vm.globalValues.values[index] = peek(0);
-        break;
+        DISPATCH();
       }
-      case OP_GET_UPVALUE:
+      CASE(OP_GET_UPVALUE):
         push(*frame->closure->upvalues[READ_BYTE()]->location);
-        break;
-      case OP_SET_UPVALUE:
-        *frame->closure->upvalues[READ_BYTE()]->location = peek0();
-        break;
-      case OP_GET_PROPERTY: {
+        DISPATCH();
+      CASE(OP_SET_UPVALUE): {
+        ObjUpvalue* upvalue = frame->closure->upvalues[READ_BYTE()];
+        PUBLISH(*upvalue->location, peek0());
+        writeBarrier(&upvalue->obj, peek0());
+        DISPATCH();
+      }
+      CASE(OP_GET_PROPERTY): {
         if (!IS_INSTANCE(peek0())) {
           frame->ip = ip;
           runtimeError("Only instances have properties.");
@@ -400,54 +750,89 @@ static InterpretResult run() {
 
         ObjInstance* instance = AS_INSTANCE(peek0());
         ObjString* name = READ_STRING();
-        Value value;
-
-        if (tableGet(&instance->fields, OBJ_VAL(name), &value)) {
-          put(value);
-          break;
+        PropertyCache* cache = READ_CACHE();
+
+        if (instance->shape == cache->shape && cache->shape != NULL) {
+          COUNT_HIT(cache);
+          if (cache->slot != -1) {
+            put(instance->slots[cache->slot]);
+          } else {
+            put(OBJ_VAL(newBoundMethod(peek0(), cache->method)));
+          }
+          DISPATCH();
         }
+
+        COUNT_MISS(cache);
         frame->ip = ip;
-        if (!bindMethod(instance->klass, name)) return INTERPRET_RUNTIME_ERROR;
-        break;
+        if (!getProperty(instance, name, cache))
+          return INTERPRET_RUNTIME_ERROR;
+        DISPATCH();
       }
-      case OP_SET_PROPERTY:
+      CASE(OP_SET_PROPERTY): {
         if (!IS_INSTANCE(peek1())) {
           frame->ip = ip;
           runtimeError("Only instances have fields.");
           return INTERPRET_RUNTIME_ERROR;
         }
 
-        tableSet(&AS_INSTANCE(peek1())->fields, READ_CONSTANT(), peek0());
+        ObjInstance* instance = AS_INSTANCE(peek1());
+        Value name = READ_CONSTANT();
+        PropertyCache* cache = READ_CACHE();
+
+        if (instance->shape == cache->shape && cache->shape != NULL &&
+            cache->slot < instance->slotCapacity) {
+          COUNT_HIT(cache);
+          PUBLISH(instance->slots[cache->slot], peek0());
+          writeBarrier(&instance->obj, peek0());
+          if (cache->transition != NULL) {
+            PUBLISH(instance->shape, cache->transition);
+            writeBarrier(&instance->obj, OBJ_VAL(cache->transition));
+          }
+        } else {
+          COUNT_MISS(cache);
+          frame->ip = ip;
+          setProperty(instance, name, peek0(), cache);
+        }
+
         put(pop());
-        break;
-      case OP_GET_SUPER:
+        DISPATCH();
+      }
+      CASE(OP_GET_SUPER):
         frame->ip = ip;
         if (!bindMethod(AS_CLASS(pop()), READ_STRING()))
           return INTERPRET_RUNTIME_ERROR;
-        break;
-      case OP_EQUAL: {
-        Value b = pop();
-        put(BOOL_VAL(valuesEqual(peek0(), b)));
-        break;
+        DISPATCH();
+      CASE(OP_EQUAL): {
+        if (IS_NUMBER(peek0()) && IS_NUMBER(peek1())) QUICKEN(OP_EQUAL_NUM);
+        bool equal = operandsEqual();
+        pop();
+        put(BOOL_VAL(equal));
+        DISPATCH();
       }
-      case OP_GREATER: BINARY_OP(BOOL_VAL, >); break;
-      case OP_LESS: BINARY_OP(BOOL_VAL, <); break;
-      case OP_ADD: {
+      CASE(OP_GREATER): COMPARE_OP(>); DISPATCH();
+      CASE(OP_LESS): COMPARE_OP(<); DISPATCH();
+      CASE(OP_ADD): {
         Value b = peek0();
         Value a = peek1();
 
-        if (IS_NUMBER(a) && IS_NUMBER(b)) {
+        if (BOTH_INTS(a, b)) {
+          QUICKEN(OP_ADD_NUM);
+          pop();
+          put(addInts(AS_INT(a), AS_INT(b)));
+        } else if (IS_NUMBER(a) && IS_NUMBER(b)) {
+          QUICKEN(OP_ADD_NUM);
           pop();
           put(NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b)));
-        } else if (IS_STRING(a) && IS_STRING(b)) {
+        } else if (isString(a) && isString(b)) {
+          QUICKEN(OP_ADD_STR);
           concatenate();
 #ifndef NO_IMPLICIT_STR_CONVERT
-        } else if (IS_STRING(a)) {
+        } else if (isString(a)) {
           push(b);
           strNative(1, vm.stackTop - 1);
           pop();
           concatenate();
-        } else if (IS_STRING(b)) {
+        } else if (isString(b)) {
           put(a);
           strNative(1, vm.stackTop - 1);
           put(b);
@@ -458,49 +843,62 @@ static InterpretResult run() {
           runtimeError("Operands must be two numbers or two strings.");
           return INTERPRET_RUNTIME_ERROR;
         }
-        break;
+        DISPATCH();
       }
-      case OP_SUBTRACT: BINARY_OP(NUMBER_VAL, -); break;
-      case OP_MULTIPLY: BINARY_OP(NUMBER_VAL, *); break;
-      case OP_DIVIDE: BINARY_OP(NUMBER_VAL, /); break;
-      case OP_NOT: put(BOOL_VAL(isFalsey(peek0()))); break;
-      case OP_NEGATE:
+      CASE(OP_SUBTRACT):
+        if (BOTH_INTS(peek0(), peek1())) {
+          int32_t b = AS_INT(pop());
+          put(subtractInts(AS_INT(peek0()), b));
+          DISPATCH();
+        }
+        BINARY_OP(NUMBER_VAL, -);
+        DISPATCH();
+      CASE(OP_MULTIPLY): BINARY_OP(NUMBER_VAL, *); DISPATCH();
+      CASE(OP_DIVIDE): BINARY_OP(NUMBER_VAL, /); DISPATCH();
+      CASE(OP_NOT): put(BOOL_VAL(isFalsey(peek0()))); DISPATCH();
+      CASE(OP_NEGATE):
+        if (IS_INT(peek0()) && AS_INT(peek0()) != 0) {
+          put(subtractInts(0, AS_INT(peek0())));
+          DISPATCH();
+        }
         if (!IS_NUMBER(peek0())) {
           frame->ip = ip;
           runtimeError("Operand must be a number.");
           return INTERPRET_RUNTIME_ERROR;
         }
         put(NUMBER_VAL(-AS_NUMBER(peek0())));
-        break;
-      case OP_PRINT:
-        printValue(pop());
-        printf("\n");
-        break;
-      case OP_JUMP: {
+        DISPATCH();
+      CASE(OP_PRINT):
+        vm.writer.length = 0;
+        writeValue(&vm.writer, pop());
+        writeChars(&vm.writer, "\n", 1);
+        fwrite(vm.writer.chars, 1, vm.writer.length, stdout);
+        DISPATCH();
+      CASE(OP_JUMP): {
         uint16_t offset = READ_SHORT();
         ip += offset;
-        break;
+        DISPATCH();
       }
-      case OP_JUMP_IF_FALSE: {
+      CASE(OP_JUMP_IF_FALSE): {
         uint16_t offset = READ_SHORT();
         if (isFalsey(peek0())) ip += offset;
-        break;
+        DISPATCH();
       }
-      case OP_LOOP: {
+      CASE(OP_LOOP): {
         uint16_t offset = READ_SHORT();
         ip -= offset;
-        break;
+        DISPATCH();
       }
-      case OP_CALL: {
+      CASE(OP_CALL): {
         int argCount = READ_BYTE();
         frame->ip = ip;
         if (!callValue(peek(argCount), argCount))
           return INTERPRET_RUNTIME_ERROR;
         frame = &vm.frames[vm.frameCount - 1];
         ip = frame->ip;
-        break;
+        DISPATCH();
       }
-      case OP_INVOKE: {
+      CASE(OP_INVOKE): {
         ObjString* method = READ_STRING();
         int argCount = READ_BYTE();
         Callsite* callsite = READ_CALLSITE();
@@ -509,38 +907,39 @@ static InterpretResult run() {
           return INTERPRET_RUNTIME_ERROR;
         frame = &vm.frames[vm.frameCount - 1];
         ip = frame->ip;
-        break;
+        DISPATCH();
       }
-      case OP_SUPER_INVOKE: {
+      CASE(OP_SUPER_INVOKE): {
         ObjString* method = READ_STRING();
         int argCount = READ_BYTE();
         Callsite* callsite = READ_CALLSITE();
         ObjClass* superclass = AS_CLASS(pop());
         frame->ip = ip;
-        if (!invokeFromClass(superclass, method, argCount, callsite))
+        if (!superInvoke(superclass, method, argCount, callsite))
           return INTERPRET_RUNTIME_ERROR;
         frame = &vm.frames[vm.frameCount - 1];
         ip = frame->ip;
-        break;
+        DISPATCH();
       }
-      case OP_CLOSURE: {
+      CASE(OP_CLOSURE): {
         ObjClosure* closure = newClosure(AS_FUNCTION(READ_CONSTANT()));
         push(OBJ_VAL(closure));
         for (int i = 0; i < closure->upvalueCount; i++) {
           uint8_t isLocal = READ_BYTE();
           uint8_t index = READ_BYTE();
           if (isLocal)
-            closure->upvalues[i] = captureUpvalue(frame->slots + index);
+            PUBLISH(closure->upvalues[i], captureUpvalue(frame->slots + index));
           else
-            closure->upvalues[i] = frame->closure->upvalues[index];
+            PUBLISH(closure->upvalues[i], frame->closure->upvalues[index]);
+          writeBarrier(&closure->obj, OBJ_VAL(closure->upvalues[i]));
         }
-        break;
+        DISPATCH();
       }
-      case OP_CLOSE_UPVALUE:
+      CASE(OP_CLOSE_UPVALUE):
         closeUpvalues(vm.stackTop - 1);
         pop();
-        break;
-      case OP_RETURN: {
+        DISPATCH();
+      CASE(OP_RETURN): {
         Value result = pop();
         closeUpvalues(frame->slots);
         vm.frameCount--;
@@ -553,10 +952,10 @@ static InterpretResult run() {
         push(result);
         frame = &vm.frames[vm.frameCount - 1];
         ip = frame->ip;
-        break;
+        DISPATCH();
       }
-      case OP_CLASS: push(OBJ_VAL(newClass(READ_STRING()))); break;
-      case OP_INHERIT: {
+      CASE(OP_CLASS): push(OBJ_VAL(newClass(READ_STRING()))); DISPATCH();
+      CASE(OP_INHERIT): {
         Value super = peek1();
         if (!IS_CLASS(super)) {
           frame->ip = ip;
@@ -568,22 +967,25 @@ static InterpretResult run() {
         ObjClass* superclass = AS_CLASS(super);
         subclass->initializer = superclass->initializer;
         tableAddAll(&superclass->methods, &subclass->methods);
+        rememberObject(&subclass->obj);
         pop();
-        break;
+        DISPATCH();
       }
-      case OP_METHOD: defineMethod(READ_STRING()); break;
-      case OP_CONSTANT_NEGATIVE_ONE: push(NUMBER_VAL(-1)); break;
-      case OP_CONSTANT_ZERO: push(NUMBER_VAL(0)); break;
-      case OP_CONSTANT_ONE: push(NUMBER_VAL(1)); break;
-      case OP_CONSTANT_TWO: push(NUMBER_VAL(2)); break;
-      case OP_CONSTANT_THREE: push(NUMBER_VAL(3)); break;
-      case OP_CONSTANT_FOUR: push(NUMBER_VAL(4)); break;
-      case OP_CONSTANT_FIVE: push(NUMBER_VAL(5)); break;
-      case OP_ADD_ONE: {
+      CASE(OP_METHOD): defineMethod(READ_STRING()); DISPATCH();
+      CASE(OP_CONSTANT_NEGATIVE_ONE): push(INT_VAL(-1)); DISPATCH();
+      CASE(OP_CONSTANT_ZERO): push(INT_VAL(0)); DISPATCH();
+      CASE(OP_CONSTANT_ONE): push(INT_VAL(1)); DISPATCH();
+      CASE(OP_CONSTANT_TWO): push(INT_VAL(2)); DISPATCH();
+      CASE(OP_CONSTANT_THREE): push(INT_VAL(3)); DISPATCH();
+      CASE(OP_CONSTANT_FOUR): push(INT_VAL(4)); DISPATCH();
+      CASE(OP_CONSTANT_FIVE): push(INT_VAL(5)); DISPATCH();
+      CASE(OP_ADD_ONE): {
         Value value = peek0();
-        if (IS_NUMBER(value)) {
+        if (IS_INT(value)) {
+          put(addInts(AS_INT(value), 1));
+        } else if (IS_NUMBER(value)) {
           put(NUMBER_VAL(AS_NUMBER(value) + 1));
-        } else if (IS_STRING(value)) {
+        } else if (isString(value)) {
           push(OBJ_VAL(copyString("1", 1)));
           concatenate();
         } else {
@@ -591,38 +993,124 @@ static InterpretResult run() {
           runtimeError("Operands must be two numbers or two strings.");
           return INTERPRET_RUNTIME_ERROR;
         }
-        break;
+        DISPATCH();
       }
-      case OP_SUBTRACT_ONE:
+      CASE(OP_SUBTRACT_ONE):
+        if (IS_INT(peek0())) {
+          put(subtractInts(AS_INT(peek0()), 1));
+          DISPATCH();
+        }
         if (!IS_NUMBER(peek0())) {
           frame->ip = ip;
           runtimeError("Operands must be numbers.");
           return INTERPRET_RUNTIME_ERROR;
         }
         put(NUMBER_VAL(AS_NUMBER(peek0()) - 1));
-        break;
-      case OP_MULTIPLY_TWO:
+        DISPATCH();
+      CASE(OP_MULTIPLY_TWO):
         if (!IS_NUMBER(peek0())) {
           frame->ip = ip;
           runtimeError("Operands must be numbers.");
           return INTERPRET_RUNTIME_ERROR;
         }
         put(NUMBER_VAL(AS_NUMBER(peek0()) * 2));
-        break;
-      case OP_EQUAL_ZERO: {
+        DISPATCH();
+      CASE(OP_EQUAL_ZERO): {
         Value a = peek0();
         put(BOOL_VAL(IS_NUMBER(a) && AS_NUMBER(a) == 0));
-        break;
+        DISPATCH();
       }
-      case OP_NOT_EQUAL: {
-        Value b = pop();
-        put(BOOL_VAL(!valuesEqual(peek0(), b)));
-        break;
+      CASE(OP_NOT_EQUAL): {
+        if (IS_NUMBER(peek0()) && IS_NUMBER(peek1()))
+          QUICKEN(OP_NOT_EQUAL_NUM);
+        bool equal = operandsEqual();
+        pop();
+        put(BOOL_VAL(!equal));
+        DISPATCH();
+      }
+      CASE(OP_GREATER_EQUAL): COMPARE_OP(>=); DISPATCH();
+      CASE(OP_LESS_EQUAL): COMPARE_OP(<=); DISPATCH();
+      CASE(OP_GET_THIS): push(*frame->slots); DISPATCH();
+      CASE(OP_DUP): push(peek0()); DISPATCH();
+      CASE(OP_ADD_NUM): {
+        if (BOTH_INTS(peek0(), peek1())) {
+          int32_t b = AS_INT(pop());
+          put(addInts(AS_INT(peek0()), b));
+          DISPATCH();
+        }
+        if (!IS_NUMBER(peek0()) || !IS_NUMBER(peek1())) {
+          UNQUICKEN(OP_ADD);
+          DISPATCH();
+        }
+        double b = AS_NUMBER(pop());
+        put(NUMBER_VAL(AS_NUMBER(peek0()) + b));
+        DISPATCH();
       }
-      case OP_GREATER_EQUAL: BINARY_OP(BOOL_VAL, >=); break;
-      case OP_LESS_EQUAL: BINARY_OP(BOOL_VAL, <=); break;
-      case OP_GET_THIS: push(*frame->slots); break;
-      case OP_DUP: push(peek0()); break;
+      CASE(OP_ADD_STR):
+        if (!isString(peek0()) || !isString(peek1())) {
+          UNQUICKEN(OP_ADD);
+          DISPATCH();
+        }
+        concatenate();
+        DISPATCH();
+      CASE(OP_EQUAL_NUM): {
+        if (BOTH_INTS(peek0(), peek1())) {
+          int32_t b = AS_INT(pop());
+          put(BOOL_VAL(AS_INT(peek0()) == b));
+          DISPATCH();
+        }
+        if (!IS_NUMBER(peek0()) || !IS_NUMBER(peek1())) {
+          UNQUICKEN(OP_EQUAL);
+          DISPATCH();
+        }
+        double b = AS_NUMBER(pop());
+        put(BOOL_VAL(AS_NUMBER(peek0()) == b));
+        DISPATCH();
+      }
+      CASE(OP_NOT_EQUAL_NUM): {
+        if (BOTH_INTS(peek0(), peek1())) {
+          int32_t b = AS_INT(pop());
+          put(BOOL_VAL(AS_INT(peek0()) != b));
+          DISPATCH();
+        }
+        if (!IS_NUMBER(peek0()) || !IS_NUMBER(peek1())) {
+          UNQUICKEN(OP_NOT_EQUAL);
+          DISPATCH();
+        }
+        double b = AS_NUMBER(pop());
+        put(BOOL_VAL(AS_NUMBER(peek0()) != b));
+        DISPATCH();
+      }
+      CASE(OP_BUILD_STRING): buildString(READ_BYTE()); DISPATCH();
+      CASE(OP_SWITCH): {
+        Chunk* chunk = &frame->closure->function->chunk;
+        SwitchTable* table = &chunk->switches[READ_SHORT()];
+        ip += switchOffset(table);
+        DISPATCH();
+      }
+      CASE(OP_POP_JUMP_IF_FALSE): {
+        uint16_t offset = READ_SHORT();
+        if (isFalsey(pop())) ip += offset;
+        DISPATCH();
+      }
+      CASE(OP_JUMP_IF_NOT_EQUAL): {
+        uint16_t offset = READ_SHORT();
+        bool equal = operandsEqual();
+        vm.stackTop -= 2;
+        if (!equal) ip += offset;
+        DISPATCH();
+      }
+      CASE(OP_JUMP_IF_EQUAL): {
+        uint16_t offset = READ_SHORT();
+        bool equal = operandsEqual();
+        vm.stackTop -= 2;
+        if (equal) ip += offset;
+        DISPATCH();
+      }
+      CASE(OP_JUMP_IF_NOT_GREATER): COMPARE_JUMP(>); DISPATCH();
+      CASE(OP_JUMP_IF_NOT_GREATER_EQUAL): COMPARE_JUMP(>=); DISPATCH();
+      CASE(OP_JUMP_IF_NOT_LESS): COMPARE_JUMP(<); DISPATCH();
+      CASE(OP_JUMP_IF_NOT_LESS_EQUAL): COMPARE_JUMP(<=); DISPATCH();
     }
   }
 
@@ -630,16 +1118,25 @@ static InterpretResult run() {
 #undef READ_SHORT
 #undef READ_CONSTANT
 #undef READ_CALLSITE
+#undef READ_CACHE
 #undef READ_STRING
+#undef TRACE_EXECUTION
 #undef BINARY_OP
+#undef COMPARE_OP
+#undef COMPARE_JUMP
+#undef QUICKEN
+#undef UNQUICKEN
+#undef CASE
+#undef DISPATCH
 }
 
-InterpretResult interpret(char* source, bool file) {
-  ObjFunction* function = compile(source);
-
-  if (file) free(source);
+InterpretResult interpret(const char* source) {
+  ObjFunction* function = compile(source, strlen(source));
   if (function == NULL) return INTERPRET_COMPILE_ERROR;
+  return interpretFunction(function);
+}
 
+InterpretResult interpretFunction(ObjFunction* function) {
   push(OBJ_VAL(function));
   ObjClosure* closure = newClosure(function);
   pop();
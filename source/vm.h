@@ -9,6 +9,10 @@ typedef struct {
   Value* slots;
 } CallFrame;
 
+#define SIZE_CLASSES 22
+
+typedef enum { GC_IDLE, GC_MARK, GC_SWEEP_STRINGS, GC_SWEEP } GCPhase;
+
 typedef struct {
   CallFrame frames[FRAMES_MAX];
   int frameCount;
@@ -20,6 +24,7 @@ typedef struct {
   ValueArray globalValues;
   Table strings;
   ObjString* initString;
+  Writer writer;
   ObjUpvalue* openUpvalues;
 
   size_t bytesAllocated;
@@ -28,6 +33,26 @@ typedef struct {
   int grayCount;
   int grayCapacity;
   Obj** grayStack;
+  GCPhase gcPhase;
+  int markEpoch;
+  size_t nextStep;
+  Obj* sweepList;
+  struct Page* sweepPage;
+  int stringCursor;
+  int stringCapacity;
+  double maxPause;
+
+  size_t youngBytes;
+  Obj* youngObjects;
+  struct Page* pages;
+  struct Page* availablePages[SIZE_CLASSES];
+  struct Page* youngPages;
+  struct Page* freePages;
+  int freePageCount;
+  bool collectingYoung;
+  int rememberedCount;
+  int rememberedCapacity;
+  Obj** remembered;
 } VM;
 
 typedef enum {
@@ -40,7 +65,8 @@ extern VM vm;
 
 void initVM();
 void freeVM();
-InterpretResult interpret(char* source, bool file);
+InterpretResult interpret(const char* source);
+InterpretResult interpretFunction(ObjFunction* function);
 void push(Value value);
 Value pop();
 